@@ -0,0 +1,273 @@
+/***
+ * Microbenchmarks for the hot paths of osmi_water on synthetic data.
+ *
+ * bench_micro [TMPDIR [SCALE]]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/visitor.hpp>
+#include <osmium/area/assembler.hpp>
+#include <osmium/geom/factory.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/geom/ogr.hpp>
+
+#include "errorsum.hpp"
+#include "locationindex.hpp"
+#include "tagcheck.hpp"
+#include "datastorage.hpp"
+#include "waterway.hpp"
+#include "falsepositives.hpp"
+#include "areahandler.hpp"
+
+#include "benchmark.hpp"
+#include "synthetic_osm.hpp"
+
+/***
+ * Fresh DataStorage with a location index filled from the buffer.
+ */
+struct Fixture {
+    std::string filename;
+    std::unique_ptr<index_pos_type> index_pos;
+    index_neg_type index_neg;
+    location_handler_type location_handler;
+    DataStorage ds;
+    WaterwayCollector waterway_collector;
+
+    Fixture(const std::string &dir, const osmium::memory::Buffer &buffer) :
+            filename(temp_filename(dir, ".sqlite")),
+            index_pos(LocationIndex::create(LocationIndex::default_type())),
+            index_neg(),
+            location_handler(*index_pos, index_neg),
+            ds(filename),
+            waterway_collector(location_handler, ds) {
+        location_handler.ignore_errors();
+        for (const auto& node : buffer.select<osmium::Node>()) {
+            location_handler.node(node);
+        }
+        index_pos->sort();
+    }
+
+    ~Fixture() {
+        std::remove(filename.c_str());
+    }
+
+    void add_waterways(const osmium::memory::Buffer &buffer) {
+        for (const auto& way : buffer.select<osmium::Way>()) {
+            waterway_collector.way_not_in_any_relation(way);
+        }
+    }
+};
+
+/***
+ * Assemble the areas of closed ways and multipolygon relations once, the
+ * ways already carry their locations.
+ */
+osmium::memory::Buffer build_areas(const osmium::memory::Buffer &buffer) {
+    osmium::area::Assembler::config_type config;
+    osmium::area::Assembler assembler(config);
+    osmium::memory::Buffer areas(1024 * 1024,
+                                 osmium::memory::Buffer::auto_grow::yes);
+    std::map<osmium::object_id_type, const osmium::Way*> ways;
+    for (const auto& way : buffer.select<osmium::Way>()) {
+        ways[way.id()] = &way;
+        if (way.is_closed() && TagCheck::is_water_area(way)) {
+            assembler(way, areas);
+        }
+    }
+    for (const auto& relation : buffer.select<osmium::Relation>()) {
+        const char* type = relation.get_value_by_key("type");
+        if (!type || strcmp(type, "multipolygon")) {
+            continue;
+        }
+        std::vector<const osmium::Way*> members;
+        for (const auto& member : relation.members()) {
+            members.push_back(ways.at(member.ref()));
+        }
+        assembler(relation, members, areas);
+    }
+    return areas;
+}
+
+template <typename T>
+std::size_t count(const osmium::memory::Buffer &buffer) {
+    std::size_t n = 0;
+    for (const auto& item : buffer.select<T>()) {
+        (void)item;
+        ++n;
+    }
+    return n;
+}
+
+void bench_tagcheck(const osmium::memory::Buffer &buffer, int repetitions) {
+    run_benchmark("TagCheck predicates",
+                  count<osmium::OSMObject>(buffer), repetitions,
+                  [&](BenchmarkTimer &timer) {
+        std::size_t accepted = 0;
+        timer.start();
+        for (const auto& object : buffer.select<osmium::OSMObject>()) {
+            bool is_relation = object.type() == osmium::item_type::relation;
+            accepted += TagCheck::is_waterway(object, is_relation);
+            accepted += TagCheck::is_way_to_analyse(object);
+            accepted += TagCheck::is_water_area(object);
+            accepted += TagCheck::is_area_to_analyse(object);
+            accepted += TagCheck::is_riverbank_or_coastline(object);
+            accepted += TagCheck::get_way_type(object).size();
+            accepted += TagCheck::get_width(object) != nullptr;
+            accepted += TagCheck::get_construction(object).size();
+        }
+        timer.stop();
+        keep_result(accepted);
+    });
+}
+
+void bench_get_width(int repetitions) {
+    static const char* widths[] = { "3", "12.5", "4 m", "0.5 km", "25'",
+                                    "3'6\"", "1 mi", "2 nmi", "3,5", "wide",
+                                    "12 ft", "3'x\"", "approx 4", nullptr };
+    const std::size_t rounds = 100000;
+    run_benchmark("DataStorage::get_width",
+                  rounds * (sizeof(widths) / sizeof(*widths)), repetitions,
+                  [&](BenchmarkTimer &timer) {
+        float sum = 0;
+        timer.start();
+        for (std::size_t r = 0; r < rounds; ++r) {
+            for (const char* width : widths) {
+                float w;
+                DataStorage::get_width(width, w);
+                sum += w;
+            }
+        }
+        timer.stop();
+        keep_result(sum);
+    });
+}
+
+void bench_analyse_nodes(const std::string &dir,
+                         const osmium::memory::Buffer &buffer,
+                         osmium::thread::Pool &pool, int repetitions) {
+    std::size_t endpoints = 0;
+    {
+        Fixture fixture(dir, buffer);
+        fixture.add_waterways(buffer);
+        endpoints = fixture.ds.node_map.size();
+    }
+    run_benchmark("WaterwayCollector::analyse_nodes", endpoints, repetitions,
+                  [&](BenchmarkTimer &timer) {
+        Fixture fixture(dir, buffer);
+        fixture.add_waterways(buffer);
+        timer.start();
+        fixture.waterway_collector.analyse_nodes();
+        fixture.ds.commit();
+        timer.stop();
+    });
+
+    const std::size_t analyse_threads = static_cast<std::size_t>(
+            pool.num_threads());
+    run_benchmark("WaterwayCollector::analyse_nodes (--analyse-threads "
+                  + std::to_string(analyse_threads) + ")", endpoints,
+                  repetitions,
+                  [&](BenchmarkTimer &timer) {
+        Fixture fixture(dir, buffer);
+        fixture.add_waterways(buffer);
+        timer.start();
+        fixture.waterway_collector.analyse_nodes(pool, analyse_threads);
+        fixture.ds.commit();
+        timer.stop();
+    });
+}
+
+void bench_area(const std::string &dir, const osmium::memory::Buffer &buffer,
+                const osmium::memory::Buffer &areas,
+                osmium::thread::Pool &pool, int repetitions) {
+    run_benchmark("AreaHandler::area", count<osmium::Area>(areas),
+                  repetitions, [&](BenchmarkTimer &timer) {
+        Fixture fixture(dir, buffer);
+        AreaHandler area_handler(fixture.ds, pool);
+        timer.start();
+        for (const auto& area : areas.select<osmium::Area>()) {
+            area_handler.area(area);
+        }
+        fixture.ds.commit();
+        timer.stop();
+    });
+
+    run_benchmark("AreaHandler::add_buffer (pool)",
+                  count<osmium::Area>(areas), repetitions,
+                  [&](BenchmarkTimer &timer) {
+        Fixture fixture(dir, buffer);
+        AreaHandler area_handler(fixture.ds, pool);
+        osmium::memory::Buffer copy(areas.committed(),
+                                    osmium::memory::Buffer::auto_grow::yes);
+        copy.add_buffer(areas);
+        copy.commit();
+        timer.start();
+        area_handler.add_buffer(std::move(copy));
+        area_handler.flush();
+        fixture.ds.commit();
+        timer.stop();
+    });
+}
+
+void bench_check_area(const std::string &dir,
+                      const osmium::memory::Buffer &buffer,
+                      const osmium::memory::Buffer &areas,
+                      osmium::thread::Pool &pool, int repetitions) {
+    std::size_t error_nodes = 0;
+    run_benchmark("IndicateFalsePositives::check_area", 1, repetitions,
+                  [&](BenchmarkTimer &timer) {
+        Fixture fixture(dir, buffer);
+        fixture.add_waterways(buffer);
+        fixture.waterway_collector.analyse_nodes();
+        AreaHandler area_handler(fixture.ds, pool);
+        for (const auto& area : areas.select<osmium::Area>()) {
+            area_handler.area(area);
+        }
+        area_handler.complete_polygon_tree();
+        IndicateFalsePositives indicate_false_positives(fixture.ds,
+                fixture.location_handler, pool);
+        error_nodes = fixture.ds.error_map.size();
+        timer.start();
+        indicate_false_positives.check_area();
+        fixture.ds.commit();
+        timer.stop();
+    });
+    std::cout << "  (" << error_nodes << " error nodes checked)\n";
+}
+
+int main(int argc, char* argv[]) {
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const int scale = argc > 2 ? atoi(argv[2]) : 1;
+    const int repetitions = 5;
+
+    SyntheticOSM::Config config;
+    config.river_networks *= scale;
+    config.lakes *= scale;
+    config.multipolygon_lakes *= scale;
+    SyntheticOSM synthetic(config);
+    osmium::memory::Buffer buffer = synthetic.buffer();
+    osmium::memory::Buffer areas = build_areas(buffer);
+    std::cout << "synthetic data: " << synthetic.num_nodes() << " nodes, "
+              << synthetic.num_ways() << " ways, "
+              << synthetic.num_relations() << " relations, "
+              << count<osmium::Area>(areas) << " areas\n";
+
+    osmium::thread::Pool pool;
+    bench_tagcheck(buffer, repetitions);
+    bench_get_width(repetitions);
+    bench_analyse_nodes(dir, buffer, pool, repetitions);
+    bench_area(dir, buffer, areas, pool, repetitions);
+    bench_check_area(dir, buffer, areas, pool, repetitions);
+}
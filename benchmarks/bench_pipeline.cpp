@@ -0,0 +1,73 @@
+/***
+ * End-to-end benchmark: runs the osmi_water binary on synthetic data in the
+ * default and in the --two-pass mode.
+ *
+ * bench_pipeline [TMPDIR [SCALE]]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <osmium/io/any_output.hpp>
+
+#include "benchmark.hpp"
+#include "synthetic_osm.hpp"
+
+#ifndef OSMI_WATER_BINARY
+# define OSMI_WATER_BINARY "osmi_water"
+#endif
+
+void bench_mode(const std::string &name, const std::string &options,
+                const std::string &dir, const std::string &input,
+                std::size_t objects, int repetitions) {
+    const std::string stats = temp_filename(dir, ".json");
+    run_benchmark(name, objects, repetitions, [&](BenchmarkTimer &timer) {
+        const std::string output = temp_filename(dir, ".sqlite");
+        const std::string command = std::string(OSMI_WATER_BINARY) + " "
+                + options + " --stats " + stats + " "
+                + input + " " + output + " >/dev/null 2>&1";
+        timer.start();
+        int result = std::system(command.c_str());
+        timer.stop();
+        std::remove(output.c_str());
+        if (result != 0) {
+            std::cerr << "command failed: " << command << '\n';
+            exit(1);
+        }
+    });
+    std::ifstream metrics(stats);
+    std::cout << "  per pass metrics of the last run:\n" << metrics.rdbuf()
+              << '\n';
+    std::remove(stats.c_str());
+}
+
+int main(int argc, char* argv[]) {
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const int scale = argc > 2 ? atoi(argv[2]) : 10;
+    const int repetitions = 3;
+
+    SyntheticOSM::Config config;
+    config.river_networks *= scale;
+    config.lakes *= scale;
+    config.multipolygon_lakes *= scale;
+    SyntheticOSM synthetic(config);
+
+    const std::string input = temp_filename(dir, ".osm.pbf");
+    {
+        osmium::io::Writer writer(input, osmium::io::overwrite::allow);
+        writer(synthetic.buffer());
+        writer.close();
+    }
+    std::cout << "synthetic data: " << synthetic.num_objects()
+              << " objects in " << input << '\n';
+
+    bench_mode("osmi_water", "", dir, input, synthetic.num_objects(),
+               repetitions);
+    bench_mode("osmi_water --two-pass", "--two-pass", dir, input,
+               synthetic.num_objects(), repetitions);
+
+    std::remove(input.c_str());
+}
@@ -0,0 +1,91 @@
+/***
+ * Minimal benchmark harness. Every benchmark runs a number of repetitions,
+ * the setup of a repetition is not measured. Reports the best and the
+ * median time and the throughput in items per second.
+ */
+
+#ifndef BENCHMARK_HPP_
+#define BENCHMARK_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+class BenchmarkTimer {
+
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::steady_clock::duration m_elapsed =
+            std::chrono::steady_clock::duration::zero();
+
+public:
+
+    void start() {
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    void stop() {
+        m_elapsed += std::chrono::steady_clock::now() - m_start;
+    }
+
+    double seconds() const {
+        return std::chrono::duration<double>(m_elapsed).count();
+    }
+};
+
+/***
+ * Run func(timer) repetitions times. func does its setup, then measures
+ * the interesting part between timer.start() and timer.stop().
+ */
+template <typename TFunc>
+void run_benchmark(const std::string &name, std::size_t items,
+                   int repetitions, TFunc &&func) {
+    std::vector<double> times;
+    for (int i = 0; i < repetitions; ++i) {
+        BenchmarkTimer timer;
+        func(timer);
+        times.push_back(timer.seconds());
+    }
+    std::sort(times.begin(), times.end());
+    const double best = times.front();
+    const double median = times[times.size() / 2];
+
+    std::cout << std::left << std::setw(36) << name << std::right
+              << std::fixed << std::setprecision(6)
+              << " best " << std::setw(10) << best << "s"
+              << " median " << std::setw(10) << median << "s";
+    if (best > 0) {
+        std::cout << std::setprecision(0) << " " << std::setw(12)
+                  << items / best << " items/s";
+    }
+    std::cout << std::endl;
+}
+
+/***
+ * Keep the compiler from dropping the result of a measured loop.
+ */
+template <typename T>
+void keep_result(const T &value) {
+    static volatile T sink;
+    sink = value;
+}
+
+/***
+ * Unique file name in dir that does not exist yet, DataStorage can not
+ * open an existing SQLite file.
+ */
+inline std::string temp_filename(const std::string &dir,
+                                 const std::string &suffix) {
+    static int counter = 0;
+    std::string filename = dir + "/osmi_water_bench_"
+                           + std::to_string(getpid()) + "_"
+                           + std::to_string(counter++) + suffix;
+    std::remove(filename.c_str());
+    return filename;
+}
+
+#endif /* BENCHMARK_HPP_ */
@@ -0,0 +1,40 @@
+/***
+ * Write the synthetic benchmark data into an OSM file.
+ *
+ * generate_synthetic OUTFILE [SCALE]
+ */
+
+#include <cstdlib>
+#include <iostream>
+
+#include <osmium/io/any_output.hpp>
+
+#include "synthetic_osm.hpp"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " OUTFILE [SCALE]\n";
+        exit(1);
+    }
+    const int scale = argc > 2 ? atoi(argv[2]) : 1;
+    if (scale < 1) {
+        std::cerr << "SCALE has to be a positive number\n";
+        exit(1);
+    }
+
+    SyntheticOSM::Config config;
+    config.river_networks *= scale;
+    config.lakes *= scale;
+    config.multipolygon_lakes *= scale;
+    SyntheticOSM synthetic(config);
+
+    osmium::io::Header header;
+    header.set("generator", "osmi_water generate_synthetic");
+    osmium::io::Writer writer(argv[1], header, osmium::io::overwrite::allow);
+    writer(synthetic.buffer());
+    writer.close();
+
+    std::cerr << "wrote " << synthetic.num_nodes() << " nodes, "
+              << synthetic.num_ways() << " ways, "
+              << synthetic.num_relations() << " relations\n";
+}
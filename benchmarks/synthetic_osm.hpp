@@ -0,0 +1,348 @@
+/***
+ * SyntheticOSM generates OSM data covering the code paths of osmi_water:
+ *  - river networks of waterway segments with tributaries, some flowing in
+ *    the wrong direction or with a different name, grouped in waterway
+ *    relations
+ *  - lakes as closed ways and as multipolygon relations with islands, river
+ *    networks ending inside a lake
+ *  - coastline ways with rivers ending on an inner node
+ *  - riverbanks along rivers
+ *  - valid and malformed width tags
+ * The output is sorted by type and id like a planet extract and only
+ * depends on the seed and the configuration.
+ */
+
+#ifndef SYNTHETIC_OSM_HPP_
+#define SYNTHETIC_OSM_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node_ref.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/osm/types.hpp>
+
+class SyntheticOSM {
+
+public:
+
+    struct Config {
+        unsigned int seed = 42;
+        int river_networks = 100;
+        int segments_per_river = 10;
+        int nodes_per_segment = 20;
+        int tributaries_per_river = 8;
+        int lakes = 50;
+        int multipolygon_lakes = 10;
+        int malformed_width_percent = 10;
+    };
+
+private:
+
+    typedef std::vector<std::pair<std::string, std::string>> tags_type;
+
+    struct Way {
+        osmium::object_id_type id;
+        std::vector<osmium::NodeRef> nodes;
+        tags_type tags;
+    };
+
+    struct Member {
+        osmium::object_id_type way_id;
+        std::string role;
+    };
+
+    struct Relation {
+        osmium::object_id_type id;
+        std::vector<Member> members;
+        tags_type tags;
+    };
+
+    Config m_config;
+    std::mt19937 m_random;
+    std::vector<osmium::NodeRef> m_nodes;
+    std::vector<Way> m_ways;
+    std::vector<Relation> m_relations;
+
+    const osmium::Timestamp m_timestamp{"2016-01-01T00:00:00Z"};
+
+    bool chance(int percent) {
+        return std::uniform_int_distribution<int>(0, 99)(m_random) < percent;
+    }
+
+    double jitter(double max) {
+        if (max <= 0) {
+            return 0;
+        }
+        return std::uniform_real_distribution<double>(-max, max)(m_random);
+    }
+
+    osmium::NodeRef add_node(double lon, double lat) {
+        osmium::NodeRef node(static_cast<osmium::object_id_type>(m_nodes.size() + 1),
+                             osmium::Location(lon, lat));
+        m_nodes.push_back(node);
+        return node;
+    }
+
+    osmium::object_id_type add_way(std::vector<osmium::NodeRef> nodes,
+                                   tags_type tags) {
+        osmium::object_id_type id = static_cast<osmium::object_id_type>(m_ways.size() + 1);
+        m_ways.push_back(Way{id, std::move(nodes), std::move(tags)});
+        return id;
+    }
+
+    void add_relation(std::vector<Member> members, tags_type tags) {
+        osmium::object_id_type id = static_cast<osmium::object_id_type>(m_relations.size() + 1);
+        m_relations.push_back(Relation{id, std::move(members), std::move(tags)});
+    }
+
+    std::string width_value() {
+        static const char* valid[] = { "3", "12.5", "4 m", "0.5 km", "25'",
+                                       "3'6\"", "1 mi" };
+        static const char* malformed[] = { "3,5", "wide", "12 ft", "3'x\"",
+                                           "approx 4" };
+        if (chance(m_config.malformed_width_percent)) {
+            return malformed[m_random() % (sizeof(malformed) / sizeof(*malformed))];
+        }
+        return valid[m_random() % (sizeof(valid) / sizeof(*valid))];
+    }
+
+    /***
+     * Polyline from the start node in direction (dx, dy) with n new nodes.
+     */
+    std::vector<osmium::NodeRef> line(const osmium::NodeRef &start, int n,
+                                      double dx, double dy) {
+        std::vector<osmium::NodeRef> nodes;
+        nodes.push_back(start);
+        double lon = start.location().lon();
+        double lat = start.location().lat();
+        for (int i = 0; i < n; ++i) {
+            lon += dx;
+            lat += dy + jitter(std::fabs(dx) / 4);
+            nodes.push_back(add_node(lon, lat));
+        }
+        return nodes;
+    }
+
+    std::vector<osmium::NodeRef> ring(double lon, double lat, double radius,
+                                      int n) {
+        std::vector<osmium::NodeRef> nodes;
+        for (int i = 0; i < n; ++i) {
+            double angle = 2 * M_PI * i / n;
+            nodes.push_back(add_node(lon + radius * std::cos(angle),
+                                     lat + radius * std::sin(angle)));
+        }
+        nodes.push_back(nodes.front());
+        return nodes;
+    }
+
+    void add_lake(double lon, double lat, double radius) {
+        add_way(ring(lon, lat, radius, 24),
+                tags_type{{"natural", "water"}, {"name", "Lake"}});
+    }
+
+    void add_multipolygon_lake(double lon, double lat, double radius) {
+        osmium::object_id_type outer = add_way(ring(lon, lat, radius, 48),
+                                               tags_type{});
+        osmium::object_id_type inner = add_way(ring(lon, lat, radius / 3, 12),
+                                               tags_type{});
+        add_relation(std::vector<Member>{{outer, "outer"}, {inner, "inner"}},
+                     tags_type{{"type", "multipolygon"},
+                               {"natural", "water"},
+                               {"name", "Island Lake"}});
+    }
+
+    void add_river_network(int index, double lon, double lat) {
+        const std::string name = "River " + std::to_string(index);
+        const double step = 0.002;
+        std::vector<Member> members;
+        std::vector<osmium::NodeRef> junctions;
+
+        osmium::NodeRef current = add_node(lon, lat);
+        for (int s = 0; s < m_config.segments_per_river; ++s) {
+            std::vector<osmium::NodeRef> nodes = line(current,
+                    m_config.nodes_per_segment - 1, step, 0);
+            current = nodes.back();
+            junctions.push_back(current);
+            tags_type tags{{"waterway", "river"}, {"name", name}};
+            if (chance(30)) {
+                tags.emplace_back("width", width_value());
+            }
+            if (chance(5)) {
+                tags.emplace_back(chance(50) ? "bridge" : "tunnel", "yes");
+            }
+            members.push_back(Member{add_way(std::move(nodes), std::move(tags)),
+                                     "main_stream"});
+        }
+        add_relation(std::move(members),
+                     tags_type{{"type", "waterway"}, {"waterway", "river"},
+                               {"name", name}});
+
+        static const char* types[] = { "stream", "brook", "ditch", "drain",
+                                       "canal" };
+        for (int t = 0; t < m_config.tributaries_per_river; ++t) {
+            const osmium::NodeRef &mouth = junctions[m_random() % junctions.size()];
+            const double dy = (t % 2 ? 1 : -1) * step;
+            std::vector<osmium::NodeRef> nodes = line(mouth,
+                    m_config.nodes_per_segment / 2, -step / 2, dy);
+            if (!chance(10)) {
+                // flows into the river, a few flow out (direction error)
+                std::reverse(nodes.begin(), nodes.end());
+            }
+            tags_type tags{{"waterway", types[m_random() % 5]}};
+            tags.emplace_back("name", chance(20) ? name : "Creek " + std::to_string(t));
+            if (chance(40)) {
+                tags.emplace_back("width", width_value());
+            }
+            add_way(std::move(nodes), std::move(tags));
+        }
+
+        if (chance(20)) {
+            // riverbank along the first segments
+            double x = lon + step * m_config.nodes_per_segment;
+            std::vector<osmium::NodeRef> nodes;
+            nodes.push_back(add_node(lon, lat - step / 2));
+            nodes.push_back(add_node(x, lat - step / 2));
+            nodes.push_back(add_node(x, lat + step / 2));
+            nodes.push_back(add_node(lon, lat + step / 2));
+            nodes.push_back(nodes.front());
+            add_way(std::move(nodes), tags_type{{"waterway", "riverbank"}});
+        }
+
+        const double end_lon = current.location().lon();
+        const double end_lat = current.location().lat();
+        switch (index % 3) {
+            case 0: {
+                // river ends inside a lake
+                add_lake(end_lon + step, end_lat, step * 3);
+                break;
+            }
+            case 1: {
+                // river ends on an inner node of the coastline
+                std::vector<osmium::NodeRef> nodes = line(add_node(end_lon, end_lat - step * 10), 9, 0, step);
+                nodes.push_back(current);
+                std::vector<osmium::NodeRef> rest = line(current, 10, 0, step);
+                nodes.insert(nodes.end(), rest.begin() + 1, rest.end());
+                add_way(std::move(nodes), tags_type{{"natural", "coastline"}});
+                break;
+            }
+            default:
+                // river ends nowhere (end error)
+                break;
+        }
+    }
+
+    template <typename TBuilder>
+    void set_attributes(TBuilder &builder, osmium::object_id_type id) {
+        builder.object().set_id(id);
+        builder.object().set_version(1);
+        builder.object().set_changeset(1);
+        builder.object().set_visible(true);
+        builder.object().set_timestamp(m_timestamp);
+    }
+
+    void add_tags(osmium::builder::Builder &parent, const tags_type &tags) {
+        if (tags.empty()) {
+            return;
+        }
+        osmium::builder::TagListBuilder tl_builder(parent);
+        for (const auto& tag : tags) {
+            tl_builder.add_tag(tag.first, tag.second);
+        }
+    }
+
+public:
+
+    explicit SyntheticOSM(const Config &config = Config()) :
+            m_config(config),
+            m_random(config.seed) {
+        const int grid = static_cast<int>(std::ceil(std::sqrt(
+                m_config.river_networks + m_config.lakes
+                + m_config.multipolygon_lakes)));
+        int cell = 0;
+        auto cell_lon = [&grid](int c) { return 5.0 + (c % grid) * 0.2; };
+        auto cell_lat = [&grid](int c) { return 45.0 + (c / grid) * 0.2; };
+        for (int i = 0; i < m_config.river_networks; ++i, ++cell) {
+            add_river_network(i, cell_lon(cell), cell_lat(cell));
+        }
+        for (int i = 0; i < m_config.lakes; ++i, ++cell) {
+            add_lake(cell_lon(cell), cell_lat(cell), 0.01 + jitter(0.005));
+        }
+        for (int i = 0; i < m_config.multipolygon_lakes; ++i, ++cell) {
+            add_multipolygon_lake(cell_lon(cell), cell_lat(cell), 0.02);
+        }
+    }
+
+    std::size_t num_nodes() const {
+        return m_nodes.size();
+    }
+
+    std::size_t num_ways() const {
+        return m_ways.size();
+    }
+
+    std::size_t num_relations() const {
+        return m_relations.size();
+    }
+
+    std::size_t num_objects() const {
+        return num_nodes() + num_ways() + num_relations();
+    }
+
+    /***
+     * Write all objects into a buffer, the way nodes have their locations
+     * set already.
+     */
+    osmium::memory::Buffer buffer() {
+        osmium::memory::Buffer buffer(1024 * 1024,
+                                      osmium::memory::Buffer::auto_grow::yes);
+        for (const auto& node : m_nodes) {
+            {
+                osmium::builder::NodeBuilder builder(buffer);
+                set_attributes(builder, node.ref());
+                builder.object().set_location(node.location());
+            }
+            buffer.commit();
+        }
+        for (const auto& way : m_ways) {
+            {
+                osmium::builder::WayBuilder builder(buffer);
+                set_attributes(builder, way.id);
+                {
+                    osmium::builder::WayNodeListBuilder wnl_builder(builder);
+                    for (const auto& node : way.nodes) {
+                        wnl_builder.add_node_ref(node);
+                    }
+                }
+                add_tags(builder, way.tags);
+            }
+            buffer.commit();
+        }
+        for (const auto& relation : m_relations) {
+            {
+                osmium::builder::RelationBuilder builder(buffer);
+                set_attributes(builder, relation.id);
+                {
+                    osmium::builder::RelationMemberListBuilder rml_builder(builder);
+                    for (const auto& member : relation.members) {
+                        rml_builder.add_member(osmium::item_type::way,
+                                               member.way_id,
+                                               member.role.c_str());
+                    }
+                }
+                add_tags(builder, relation.tags);
+            }
+            buffer.commit();
+        }
+        return buffer;
+    }
+};
+
+#endif /* SYNTHETIC_OSM_HPP_ */
@@ -1,28 +1,65 @@
 /***
  * AreaHandler inserts all found polygons to polygons table.
+ *
+ * The area buffers of the MultipolygonManager are handed to a thread pool,
+ * which creates the OGR geometries and the fixed point polygons. The
+ * results are taken back in the order the buffers arrived and inserted into
+ * the polygons table and the polygon_tree on the calling thread.
  */
 
 #ifndef AREAHANDLER_HPP_
 #define AREAHANDLER_HPP_
 
+#include <chrono>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <vector>
 #include <osmium/handler.hpp>
 #include <osmium/geom/ogr.hpp>
-#include <osmium/geom/geos.hpp>
-#include <osmium_geos_factory/geos_factory.hpp>
-#include <geos/simplify/TopologyPreservingSimplifier.h>
-#include <geos/geom/prep/PreparedPolygon.h>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/thread/pool.hpp>
 
-
-typedef geos::geom::prep::PreparedPolygon prepared_polygon_type;
+#include "fixedpolygon.hpp"
 
 class AreaHandler: public osmium::handler::Handler {
 
+    /***
+     * Geometries of one area created by a worker thread.
+     */
+    struct PreparedArea {
+        const osmium::Area *area;
+        TagClass tags;
+        bool analyse = false;
+        bool geometry_error = false;
+        bool unexpected_error = false;
+        std::unique_ptr<OGRMultiPolygon> ogr_multipolygon;
+        std::vector<FixedPolygon> fixed_polygons;
+
+        PreparedArea(const osmium::Area &area, const TagClass &tags) :
+                area(&area),
+                tags(tags) {
+        }
+    };
+
+    /***
+     * The buffer is kept alive until the areas are inserted.
+     */
+    struct AreaBatch {
+        std::shared_ptr<osmium::memory::Buffer> buffer;
+        std::vector<PreparedArea> areas;
+    };
+
+    static constexpr std::size_t max_pending_batches = 64;
+
     DataStorage &ds;
+    osmium::thread::Pool &pool;
+    std::deque<std::future<AreaBatch>> pending_batches;
     int count_polygons = 0;
 
-    bool is_valid(const osmium::Area& area) {
-        return TagCheck::is_water_area(area);
+    static bool is_valid(const TagClass &tags) {
+        return TagCheck::is_water_area(tags);
     }
 
     void error_message(const osmium::Area &area) {
@@ -34,67 +71,175 @@ class AreaHandler: public osmium::handler::Handler {
         std::cerr << area.orig_id() << '\n';
     }
 
-    void insert_in_polygon_tree(const osmium::Area &area) {
-        osmium_geos_factory::GEOSFactory<> osmium_geos_factory;
-        std::unique_ptr<geos::geom::MultiPolygon> geos_multipolygon;
-        try {
-            geos_multipolygon = std::move(osmium_geos_factory.create_multipolygon(area));
-        } catch (...) {
-            error_message(area);
-            std::cerr << "While init polygon_tree.\n";
-            return;
+    /***
+     * Runs in a worker thread, must not touch the DataStorage. The rings
+     * of the area are in fixed point already.
+     */
+    static void prepare_polygons(PreparedArea &prepared) {
+        const osmium::Area &area = *prepared.area;
+        for (const auto& outer_ring : area.outer_rings()) {
+            prepared.fixed_polygons.emplace_back(area, outer_ring);
         }
+    }
 
-        for (auto geos_polygon : *geos_multipolygon) {
-            std::unique_ptr<prepared_polygon_type> prepared_polygon;
+    /***
+     * Runs in a worker thread, must not touch the DataStorage.
+     */
+    static AreaBatch prepare_batch(std::shared_ptr<osmium::memory::Buffer> buffer) {
+        osmium::geom::OGRFactory<> ogr_factory;
+        AreaBatch batch;
+        batch.buffer = buffer;
+        for (const auto& area : buffer->select<osmium::Area>()) {
+            const TagClass tags = TagCheck::classify(area);
+            if (!is_valid(tags)) {
+                continue;
+            }
+            batch.areas.emplace_back(area, tags);
+            PreparedArea &prepared = batch.areas.back();
             try {
-                prepared_polygon.reset(new prepared_polygon_type(geos_polygon));
+                prepared.ogr_multipolygon = ogr_factory.create_multipolygon(area);
+            } catch (osmium::geometry_error&) {
+                prepared.geometry_error = true;
+                continue;
             } catch (...) {
+                prepared.unexpected_error = true;
+                continue;
+            }
+            prepared.analyse = TagCheck::is_area_to_analyse(tags);
+            if (prepared.analyse) {
+                prepare_polygons(prepared);
+            }
+        }
+        return batch;
+    }
+
+    void insert_in_polygon_tree(PreparedArea &prepared) {
+        for (auto& fixed_polygon : prepared.fixed_polygons) {
+            add_polygon(std::move(fixed_polygon));
+        }
+    }
+
+    void insert_batch(AreaBatch batch) {
+        for (auto& prepared : batch.areas) {
+            const osmium::Area &area = *prepared.area;
+            if (prepared.geometry_error) {
+                error_message(area);
+                continue;
+            }
+            if (prepared.unexpected_error) {
                 error_message(area);
-                std::cerr << "While init polygon_tree.\n";
+                std::cerr << "Unexpected error\n";
                 continue;
             }
-            const geos::geom::Envelope *envelope;
-            envelope = geos_polygon->getEnvelopeInternal();
-            ds.polygon_tree.insert(envelope, prepared_polygon.get());
-            ds.prepared_polygon_set.push_back(std::move(prepared_polygon));
-            count_polygons++;
+            try {
+                ds.insert_polygon_feature(std::move(prepared.ogr_multipolygon),
+                                          area, prepared.tags);
+                if (prepared.analyse) {
+                    if (ds.change_state()) {
+                        ds.change_state()->add_analysed_area(area.id());
+                    }
+                    insert_in_polygon_tree(prepared);
+                }
+            } catch (osmium::geometry_error&) {
+                error_message(area);
+            } catch (...) {
+                error_message(area);
+                std::cerr << "Unexpected error\n";
+            }
         }
-        ds.multipolygon_set.push_back(std::move(geos_multipolygon));
+    }
+
+    void insert_next_batch() {
+        AreaBatch batch = pending_batches.front().get();
+        pending_batches.pop_front();
+        insert_batch(std::move(batch));
     }
 
 public:
 
-    AreaHandler(DataStorage &data_storage) :
-            ds(data_storage) {
+    AreaHandler(DataStorage &data_storage, osmium::thread::Pool &pool) :
+            ds(data_storage),
+            pool(pool) {
     }
-    
-    void complete_polygon_tree() {
-        if (count_polygons == 0) {
-            geos::geom::GeometryFactory::unique_ptr geos_factory = geos::geom::GeometryFactory::create();
-            geos::geom::Point *point;
-            geos::geom::Coordinate coord(0, 0);
-            point = geos_factory->createPoint(coord);
-            ds.polygon_tree.insert(point->getEnvelopeInternal(), nullptr);
+
+    /***
+     * Callback for the MultipolygonManager. Hands the buffer to the thread
+     * pool and inserts the finished batches, waiting only if too many are
+     * in flight.
+     */
+    void add_buffer(osmium::memory::Buffer &&area_buffer) {
+        std::shared_ptr<osmium::memory::Buffer> buffer =
+                std::make_shared<osmium::memory::Buffer>(std::move(area_buffer));
+        pending_batches.push_back(pool.submit([buffer] {
+            return prepare_batch(buffer);
+        }));
+        while (pending_batches.size() > max_pending_batches) {
+            insert_next_batch();
+        }
+        while (!pending_batches.empty() &&
+                pending_batches.front().wait_for(std::chrono::seconds(0))
+                == std::future_status::ready) {
+            insert_next_batch();
+        }
+    }
+
+    /***
+     * Insert all remaining batches. Must be called at the end of pass 2.
+     */
+    void flush() {
+        while (!pending_batches.empty()) {
+            insert_next_batch();
         }
     }
 
+    /***
+     * Insert a polygon into the polygon tree, also used for the polygons
+     * of a snapshot (--resume).
+     */
+    void add_polygon(FixedPolygon &&fixed_polygon) {
+        if (fixed_polygon.edges().empty()) {
+            return;
+        }
+        const osmium::Location bottom_left = fixed_polygon.bottom_left();
+        const osmium::Location top_right = fixed_polygon.top_right();
+        ds.polygon_tree.add(bottom_left.lon(), bottom_left.lat(),
+                            top_right.lon(), top_right.lat(),
+                            static_cast<uint32_t>(ds.fixed_polygon_set.size()));
+        ds.fixed_polygon_set.push_back(std::move(fixed_polygon));
+        count_polygons++;
+    }
+
+    void complete_polygon_tree() {
+        flush();
+        ds.polygon_tree.build();
+    }
+
+    /***
+     * Synchronous path for single areas.
+     */
     void area(const osmium::Area &area) {
-        osmium::geom::OGRFactory<> ogr_factory;
-        if (!is_valid(area)) {
+        const TagClass tags = TagCheck::classify(area);
+        if (!is_valid(tags)) {
             return;
         }
+        AreaBatch batch;
+        batch.areas.emplace_back(area, tags);
+        PreparedArea &prepared = batch.areas.back();
+        osmium::geom::OGRFactory<> ogr_factory;
         try {
-            ds.insert_polygon_feature(ogr_factory.create_multipolygon(area), area);
-            if (TagCheck::is_area_to_analyse(area)) {
-                insert_in_polygon_tree(area);
-            }
+            prepared.ogr_multipolygon = ogr_factory.create_multipolygon(area);
         } catch (osmium::geometry_error&) {
-            error_message(area);
+            prepared.geometry_error = true;
         } catch (...) {
-            error_message(area);
-            std::cerr << "Unexpected error\n";
+            prepared.unexpected_error = true;
+        }
+        if (prepared.ogr_multipolygon) {
+            prepared.analyse = TagCheck::is_area_to_analyse(tags);
+        }
+        if (prepared.analyse) {
+            prepare_polygons(prepared);
         }
+        insert_batch(std::move(batch));
     }
 };
 
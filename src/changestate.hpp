@@ -0,0 +1,819 @@
+/***
+ * ChangeState is the part of a run needed to apply a change file later
+ * (--state FILE, --update):
+ *  - every row of the ways table with its end nodes, name and type
+ *  - the nodes of every way checked by IndicateFalsePositives
+ *  - the ids of the water polygons used for the false positive check
+ * The node locations are not part of the state, they are kept in a file
+ * based location index (-i dense_file_array,FILE).
+ *
+ * FILE is the base, flat arrays sorted for lookups and mapped into memory
+ * as they are:
+ *  - the rows sorted by way id and the arena of their names and types
+ *  - the end nodes of the rows sorted by node id
+ *  - the checked nodes of every way and the number of visits of every
+ *    checked node, sorted by node id
+ *  - the analysed polygons
+ * An update reads only the parts of the base it needs. The ways it changed
+ * are appended to FILE.delta, which replaces their rows and checked nodes
+ * in the base. When the delta reaches 1/compact_ratio of the base, the
+ * base is written again with the delta merged and the delta is removed.
+ */
+
+#ifndef CHANGESTATE_HPP_
+#define CHANGESTATE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <osmium/osm/types.hpp>
+
+
+class ChangeState {
+
+public:
+
+    /***
+     * One row of the ways table. A way in several relations has several
+     * rows.
+     */
+    struct WayRecord {
+        osmium::object_id_type way_id;
+        osmium::object_id_type relation_id;
+        osmium::object_id_type first_node;
+        osmium::object_id_type last_node;
+        std::string name;
+        std::string type;
+    };
+
+private:
+
+    enum {
+        compact_ratio = 8
+    };
+
+    /***
+     * A row in the base, name and type are stored one after the other in
+     * the strings section.
+     */
+    struct WayRow {
+        int64_t way_id;
+        int64_t relation_id;
+        int64_t first_node;
+        int64_t last_node;
+        uint64_t strings;
+        uint32_t name_size;
+        uint32_t type_size;
+    };
+
+    struct EndpointRow {
+        int64_t node_id;
+        uint64_t row;
+    };
+
+    struct CheckedRow {
+        int64_t way_id;
+        uint64_t first;
+        uint64_t count;
+    };
+
+    struct VisitRow {
+        int64_t node_id;
+        int64_t visits;
+    };
+
+    enum section_type {
+        ways_section = 0,
+        strings_section,
+        endpoints_section,
+        checked_section,
+        checked_nodes_section,
+        visits_section,
+        areas_section,
+        num_sections
+    };
+
+    struct Section {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    /***
+     * The delta belongs to the base with the same generation.
+     */
+    struct Header {
+        char magic[16];
+        uint64_t generation;
+        Section sections[num_sections];
+    };
+
+    /***
+     * The state of a way changed after the base was written. It replaces
+     * all rows and checked nodes of the way in the base, a deleted way has
+     * none.
+     */
+    struct WayChange {
+        std::vector<WayRecord> rows;
+        std::vector<osmium::object_id_type> checked_nodes;
+    };
+
+    static const char *magic() {
+        return "osmi_water stat2";
+    }
+
+    static const char *delta_magic() {
+        return "osmi_water delta";
+    }
+
+    const char *m_data = nullptr;
+    std::size_t m_size = 0;
+    const Header *m_header = nullptr;
+
+    std::unordered_map<osmium::object_id_type, WayChange> m_changes;
+    std::vector<osmium::object_id_type> m_changed_ways;
+    std::unordered_set<osmium::object_id_type> m_changed_now;
+    std::size_t m_delta_entries = 0;
+    std::vector<osmium::object_id_type> m_analysed_areas;
+
+    template <typename T>
+    static void write_value(std::ofstream &out, const T &value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void read_value(std::ifstream &in, T &value) {
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+
+    static void write_string(std::ofstream &out, const std::string &str) {
+        write_value(out, static_cast<uint32_t>(str.size()));
+        out.write(str.data(), str.size());
+    }
+
+    /***
+     * Whether count items of item_size bytes can follow in a file of
+     * file_size bytes. If not, the stream is marked failed, so a corrupt
+     * size never allocates more than the file holds.
+     */
+    static bool fits(std::ifstream &in, uint64_t count, std::size_t item_size,
+                     uint64_t file_size) {
+        const std::streamoff position = in.tellg();
+        if (!in || position < 0
+                || count > (file_size - static_cast<uint64_t>(position))
+                           / item_size) {
+            in.setstate(std::ios::failbit);
+            return false;
+        }
+        return true;
+    }
+
+    static void read_string(std::ifstream &in, std::string &str,
+                            uint64_t file_size) {
+        uint32_t size = 0;
+        read_value(in, size);
+        if (!fits(in, size, sizeof(char), file_size)) {
+            return;
+        }
+        str.resize(size);
+        in.read(&str[0], size);
+    }
+
+    static void write_ids(std::ofstream &out,
+                          const std::vector<osmium::object_id_type> &ids) {
+        write_value(out, static_cast<uint64_t>(ids.size()));
+        out.write(reinterpret_cast<const char*>(ids.data()),
+                  ids.size() * sizeof(osmium::object_id_type));
+    }
+
+    static void read_ids(std::ifstream &in,
+                         std::vector<osmium::object_id_type> &ids,
+                         uint64_t file_size) {
+        uint64_t size = 0;
+        read_value(in, size);
+        if (!fits(in, size, sizeof(osmium::object_id_type), file_size)) {
+            return;
+        }
+        ids.resize(size);
+        in.read(reinterpret_cast<char*>(ids.data()),
+                size * sizeof(osmium::object_id_type));
+    }
+
+    /***
+     * Append a section 8 byte aligned and remember its position.
+     */
+    template <typename T>
+    static void write_section(std::ofstream &out, Header &header,
+                              section_type section,
+                              const std::vector<T> &items) {
+        static const char zeros[8] = {0};
+        const uint64_t position = static_cast<uint64_t>(out.tellp());
+        const uint64_t aligned = (position + 7) & ~static_cast<uint64_t>(7);
+        out.write(zeros, aligned - position);
+        header.sections[section].offset = aligned;
+        header.sections[section].size = items.size();
+        out.write(reinterpret_cast<const char*>(items.data()),
+                  items.size() * sizeof(T));
+    }
+
+    template <typename T>
+    const T *section_begin(section_type section) const {
+        if (!m_header) {
+            return nullptr;
+        }
+        return reinterpret_cast<const T*>(m_data
+                + m_header->sections[section].offset);
+    }
+
+    template <typename T>
+    const T *section_end(section_type section) const {
+        return section_begin<T>(section) + section_size(section);
+    }
+
+    std::size_t section_size(section_type section) const {
+        return m_header ? m_header->sections[section].size : 0;
+    }
+
+    /***
+     * Whether the section is aligned and its items of item_size bytes lie
+     * between the header and the end of the file.
+     */
+    bool valid_section(section_type section, std::size_t item_size) const {
+        const Section &position = m_header->sections[section];
+        return position.offset % 8 == 0
+               && position.offset >= sizeof(Header)
+               && position.offset <= m_size
+               && position.size <= (m_size - position.offset) / item_size;
+    }
+
+    /***
+     * Check that all sections lie inside the file and all offsets stored
+     * in them point into the sections they refer to, so a truncated or
+     * corrupt file is never read beyond the mapping.
+     */
+    bool valid() const {
+        if (!valid_section(ways_section, sizeof(WayRow))
+                || !valid_section(strings_section, sizeof(char))
+                || !valid_section(endpoints_section, sizeof(EndpointRow))
+                || !valid_section(checked_section, sizeof(CheckedRow))
+                || !valid_section(checked_nodes_section, sizeof(int64_t))
+                || !valid_section(visits_section, sizeof(VisitRow))
+                || !valid_section(areas_section, sizeof(int64_t))) {
+            return false;
+        }
+        const uint64_t num_strings = section_size(strings_section);
+        for (const WayRow *row = section_begin<WayRow>(ways_section);
+                row != section_end<WayRow>(ways_section); ++row) {
+            if (row->strings > num_strings
+                    || static_cast<uint64_t>(row->name_size) + row->type_size
+                       > num_strings - row->strings) {
+                return false;
+            }
+        }
+        for (const EndpointRow *endpoint = section_begin<EndpointRow>(
+                    endpoints_section);
+                endpoint != section_end<EndpointRow>(endpoints_section);
+                ++endpoint) {
+            if (endpoint->row >= section_size(ways_section)) {
+                return false;
+            }
+        }
+        const uint64_t num_checked_nodes = section_size(checked_nodes_section);
+        for (const CheckedRow *checked = section_begin<CheckedRow>(
+                    checked_section);
+                checked != section_end<CheckedRow>(checked_section);
+                ++checked) {
+            if (checked->first > num_checked_nodes
+                    || checked->count > num_checked_nodes - checked->first) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string delta_filename(const std::string &filename) {
+        return filename + ".delta";
+    }
+
+    WayRecord to_record(const WayRow &row) const {
+        const char *strings = section_begin<char>(strings_section)
+                              + row.strings;
+        return WayRecord{row.way_id, row.relation_id, row.first_node,
+                         row.last_node, std::string(strings, row.name_size),
+                         std::string(strings + row.name_size, row.type_size)};
+    }
+
+    /***
+     * The rows of way_id in the base.
+     */
+    std::pair<const WayRow*, const WayRow*> base_rows(
+            osmium::object_id_type way_id) const {
+        const WayRow *first = std::lower_bound(
+                section_begin<WayRow>(ways_section),
+                section_end<WayRow>(ways_section), way_id,
+                [](const WayRow &row, osmium::object_id_type id) {
+                    return row.way_id < id;
+                });
+        const WayRow *last = first;
+        while (last != section_end<WayRow>(ways_section)
+                && last->way_id == way_id) {
+            ++last;
+        }
+        return std::make_pair(first, last);
+    }
+
+    /***
+     * The checked nodes of way_id in the base.
+     */
+    std::pair<const int64_t*, const int64_t*> base_checked_nodes(
+            osmium::object_id_type way_id) const {
+        const CheckedRow *end = section_end<CheckedRow>(checked_section);
+        const CheckedRow *checked = std::lower_bound(
+                section_begin<CheckedRow>(checked_section), end, way_id,
+                [](const CheckedRow &row, osmium::object_id_type id) {
+                    return row.way_id < id;
+                });
+        if (checked == end || checked->way_id != way_id) {
+            return std::make_pair(nullptr, nullptr);
+        }
+        const int64_t *nodes = section_begin<int64_t>(checked_nodes_section)
+                               + checked->first;
+        return std::make_pair(nodes, nodes + checked->count);
+    }
+
+    /***
+     * The change of way_id, created with the rows and checked nodes of
+     * the base.
+     */
+    WayChange& change(osmium::object_id_type way_id) {
+        if (m_changed_now.insert(way_id).second) {
+            m_changed_ways.push_back(way_id);
+        }
+        auto existing = m_changes.find(way_id);
+        if (existing != m_changes.end()) {
+            return existing->second;
+        }
+        WayChange &way_change = m_changes[way_id];
+        const auto rows = base_rows(way_id);
+        for (const WayRow *row = rows.first; row != rows.second; ++row) {
+            way_change.rows.push_back(to_record(*row));
+        }
+        const auto nodes = base_checked_nodes(way_id);
+        way_change.checked_nodes.assign(nodes.first, nodes.second);
+        return way_change;
+    }
+
+    bool delta_too_big() const {
+        return (m_delta_entries + m_changed_ways.size()) * compact_ratio
+               >= section_size(ways_section);
+    }
+
+    void read_delta(const std::string &filename) {
+        std::ifstream in(delta_filename(filename), std::ios::binary);
+        if (!in) {
+            return;
+        }
+        in.seekg(0, std::ios::end);
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+        std::string header(strlen(delta_magic()), '\0');
+        in.read(&header[0], header.size());
+        uint64_t generation = 0;
+        read_value(in, generation);
+        if (!in || header != delta_magic()) {
+            throw std::runtime_error("Not a state delta: "
+                                     + delta_filename(filename));
+        }
+        if (generation != m_header->generation) {
+            std::cerr << "Ignoring " << delta_filename(filename)
+                      << ", it belongs to an older state\n";
+            return;
+        }
+        while (true) {
+            uint64_t num_ways = 0;
+            read_value(in, num_ways);
+            if (in.eof()) {
+                break;
+            }
+            for (uint64_t i = 0; in && i < num_ways; ++i) {
+                osmium::object_id_type way_id = 0;
+                read_value(in, way_id);
+                WayChange &way_change = m_changes[way_id];
+                uint64_t num_rows = 0;
+                read_value(in, num_rows);
+                if (!fits(in, num_rows, 3 * sizeof(osmium::object_id_type),
+                          file_size)) {
+                    break;
+                }
+                way_change.rows.resize(num_rows);
+                for (auto& record : way_change.rows) {
+                    record.way_id = way_id;
+                    read_value(in, record.relation_id);
+                    read_value(in, record.first_node);
+                    read_value(in, record.last_node);
+                    read_string(in, record.name, file_size);
+                    read_string(in, record.type, file_size);
+                }
+                read_ids(in, way_change.checked_nodes, file_size);
+                ++m_delta_entries;
+            }
+            uint64_t end_marker = 0;
+            read_value(in, end_marker);
+            if (!in || end_marker != num_ways) {
+                throw std::runtime_error("State delta is truncated or corrupt: "
+                                         + delta_filename(filename));
+            }
+        }
+    }
+
+    /***
+     * Append the ways changed since read() to the delta.
+     */
+    void append_delta(const std::string &filename) {
+        const bool exists = std::ifstream(delta_filename(filename)).good()
+                            && m_delta_entries;
+        std::ofstream out(delta_filename(filename), exists
+                ? std::ios::binary | std::ios::app
+                : std::ios::binary | std::ios::trunc);
+        if (!exists) {
+            out.write(delta_magic(), strlen(delta_magic()));
+            write_value(out, m_header->generation);
+        }
+        write_value(out, static_cast<uint64_t>(m_changed_ways.size()));
+        for (auto way_id : m_changed_ways) {
+            const WayChange &way_change = m_changes[way_id];
+            write_value(out, way_id);
+            write_value(out, static_cast<uint64_t>(way_change.rows.size()));
+            for (const auto& record : way_change.rows) {
+                write_value(out, record.relation_id);
+                write_value(out, record.first_node);
+                write_value(out, record.last_node);
+                write_string(out, record.name);
+                write_string(out, record.type);
+            }
+            write_ids(out, way_change.checked_nodes);
+        }
+        write_value(out, static_cast<uint64_t>(m_changed_ways.size()));
+        if (!out) {
+            throw std::runtime_error("Failed to write state delta "
+                                     + delta_filename(filename));
+        }
+    }
+
+    /***
+     * Write the base with the delta merged to a temporary file first, so
+     * a failed write keeps the old state.
+     */
+    void write_base(const std::string &filename) {
+        std::vector<WayRow> rows;
+        std::vector<char> strings;
+        auto add_row = [&rows, &strings](const WayRecord &record) {
+            rows.push_back(WayRow{record.way_id, record.relation_id,
+                                  record.first_node, record.last_node,
+                                  strings.size(),
+                                  static_cast<uint32_t>(record.name.size()),
+                                  static_cast<uint32_t>(record.type.size())});
+            strings.insert(strings.end(), record.name.begin(),
+                           record.name.end());
+            strings.insert(strings.end(), record.type.begin(),
+                           record.type.end());
+        };
+        for (const WayRow *row = section_begin<WayRow>(ways_section);
+                row != section_end<WayRow>(ways_section); ++row) {
+            if (!m_changes.count(row->way_id)) {
+                add_row(to_record(*row));
+            }
+        }
+        for (const auto& way_change : m_changes) {
+            for (const auto& record : way_change.second.rows) {
+                add_row(record);
+            }
+        }
+        std::stable_sort(rows.begin(), rows.end(),
+                         [](const WayRow &a, const WayRow &b) {
+                             return a.way_id < b.way_id;
+                         });
+
+        std::vector<EndpointRow> endpoints;
+        endpoints.reserve(rows.size() * 2);
+        for (uint64_t i = 0; i < rows.size(); ++i) {
+            endpoints.push_back(EndpointRow{rows[i].first_node, i});
+            endpoints.push_back(EndpointRow{rows[i].last_node, i});
+        }
+        std::sort(endpoints.begin(), endpoints.end(),
+                  [](const EndpointRow &a, const EndpointRow &b) {
+                      return a.node_id < b.node_id
+                             || (a.node_id == b.node_id && a.row < b.row);
+                  });
+
+        typedef std::pair<const int64_t*, const int64_t*> range_type;
+        std::vector<std::pair<osmium::object_id_type, range_type>> sources;
+        for (const CheckedRow *checked = section_begin<CheckedRow>(
+                    checked_section);
+                checked != section_end<CheckedRow>(checked_section);
+                ++checked) {
+            if (!m_changes.count(checked->way_id)) {
+                const int64_t *nodes = section_begin<int64_t>(
+                        checked_nodes_section) + checked->first;
+                sources.emplace_back(checked->way_id,
+                                     range_type(nodes, nodes + checked->count));
+            }
+        }
+        for (const auto& way_change : m_changes) {
+            const auto &nodes = way_change.second.checked_nodes;
+            if (!nodes.empty()) {
+                sources.emplace_back(way_change.first, range_type(
+                        nodes.data(), nodes.data() + nodes.size()));
+            }
+        }
+        std::sort(sources.begin(), sources.end(),
+                  [](const std::pair<osmium::object_id_type, range_type> &a,
+                     const std::pair<osmium::object_id_type, range_type> &b) {
+                      return a.first < b.first;
+                  });
+        std::vector<CheckedRow> checked;
+        std::vector<int64_t> checked_nodes;
+        for (const auto& source : sources) {
+            checked.push_back(CheckedRow{source.first, checked_nodes.size(),
+                    static_cast<uint64_t>(source.second.second
+                                          - source.second.first)});
+            checked_nodes.insert(checked_nodes.end(), source.second.first,
+                                 source.second.second);
+        }
+        std::vector<VisitRow> visits;
+        {
+            std::vector<int64_t> nodes(checked_nodes);
+            std::sort(nodes.begin(), nodes.end());
+            for (auto node_id : nodes) {
+                if (visits.empty() || visits.back().node_id != node_id) {
+                    visits.push_back(VisitRow{node_id, 0});
+                }
+                ++visits.back().visits;
+            }
+        }
+
+        std::vector<int64_t> areas(section_begin<int64_t>(areas_section),
+                                   section_end<int64_t>(areas_section));
+        areas.insert(areas.end(), m_analysed_areas.begin(),
+                     m_analysed_areas.end());
+        std::sort(areas.begin(), areas.end());
+        areas.erase(std::unique(areas.begin(), areas.end()), areas.end());
+
+        const std::string tmp_filename = filename + ".tmp";
+        {
+            std::ofstream out(tmp_filename, std::ios::binary);
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, magic(), sizeof(header.magic));
+            header.generation = static_cast<uint64_t>(
+                    std::chrono::system_clock::now().time_since_epoch()
+                    .count());
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            write_section(out, header, ways_section, rows);
+            write_section(out, header, strings_section, strings);
+            write_section(out, header, endpoints_section, endpoints);
+            write_section(out, header, checked_section, checked);
+            write_section(out, header, checked_nodes_section, checked_nodes);
+            write_section(out, header, visits_section, visits);
+            write_section(out, header, areas_section, areas);
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (!out) {
+                throw std::runtime_error("Failed to write state file "
+                                         + tmp_filename);
+            }
+        }
+        if (std::rename(tmp_filename.c_str(), filename.c_str())) {
+            throw std::runtime_error("Failed to rename state file "
+                                     + tmp_filename);
+        }
+        std::remove(delta_filename(filename).c_str());
+    }
+
+public:
+
+    ChangeState() = default;
+
+    ChangeState(const ChangeState&) = delete;
+    ChangeState& operator=(const ChangeState&) = delete;
+
+    ~ChangeState() {
+        if (m_data) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+    void add_way(osmium::object_id_type way_id,
+                 osmium::object_id_type relation_id,
+                 osmium::object_id_type first_node,
+                 osmium::object_id_type last_node,
+                 const std::string &name, const std::string &type) {
+        change(way_id).rows.push_back(WayRecord{way_id, relation_id,
+                first_node, last_node, name, type});
+    }
+
+    void set_checked_nodes(osmium::object_id_type way_id,
+                           std::vector<osmium::object_id_type> &&nodes) {
+        change(way_id).checked_nodes = std::move(nodes);
+    }
+
+    void add_analysed_area(osmium::object_id_type area_id) {
+        m_analysed_areas.push_back(area_id);
+    }
+
+    /***
+     * Sort the area ids added since read() for is_analysed_area().
+     */
+    void sort_areas() {
+        std::sort(m_analysed_areas.begin(), m_analysed_areas.end());
+        m_analysed_areas.erase(std::unique(m_analysed_areas.begin(),
+                                           m_analysed_areas.end()),
+                               m_analysed_areas.end());
+    }
+
+    bool is_analysed_area(osmium::object_id_type area_id) const {
+        return std::binary_search(section_begin<int64_t>(areas_section),
+                                  section_end<int64_t>(areas_section),
+                                  area_id)
+               || std::binary_search(m_analysed_areas.begin(),
+                                     m_analysed_areas.end(), area_id);
+    }
+
+    /***
+     * Remove the rows and the checked nodes of the way, return the rows.
+     */
+    std::vector<WayRecord> remove_way(osmium::object_id_type way_id) {
+        WayChange &way_change = change(way_id);
+        std::vector<WayRecord> removed;
+        removed.swap(way_change.rows);
+        way_change.checked_nodes.clear();
+        return removed;
+    }
+
+    /***
+     * The rows of the way, from the delta if it changed.
+     */
+    std::vector<WayRecord> way_rows(osmium::object_id_type way_id) const {
+        auto way_change = m_changes.find(way_id);
+        if (way_change != m_changes.end()) {
+            return way_change->second.rows;
+        }
+        std::vector<WayRecord> rows;
+        const auto base = base_rows(way_id);
+        for (const WayRow *row = base.first; row != base.second; ++row) {
+            rows.push_back(to_record(*row));
+        }
+        return rows;
+    }
+
+    std::vector<osmium::object_id_type> checked_nodes(
+            osmium::object_id_type way_id) const {
+        auto way_change = m_changes.find(way_id);
+        if (way_change != m_changes.end()) {
+            return way_change->second.checked_nodes;
+        }
+        const auto nodes = base_checked_nodes(way_id);
+        return std::vector<osmium::object_id_type>(nodes.first, nodes.second);
+    }
+
+    /***
+     * Call func(record) once for every row with its first or last node in
+     * node_ids.
+     */
+    template <typename TFunc>
+    void for_each_way_at(
+            const std::unordered_set<osmium::object_id_type> &node_ids,
+            TFunc &&func) const {
+        std::vector<uint64_t> base;
+        for (auto node_id : node_ids) {
+            const EndpointRow *endpoint = std::lower_bound(
+                    section_begin<EndpointRow>(endpoints_section),
+                    section_end<EndpointRow>(endpoints_section), node_id,
+                    [](const EndpointRow &row, osmium::object_id_type id) {
+                        return row.node_id < id;
+                    });
+            for (; endpoint != section_end<EndpointRow>(endpoints_section)
+                    && endpoint->node_id == node_id; ++endpoint) {
+                base.push_back(endpoint->row);
+            }
+        }
+        std::sort(base.begin(), base.end());
+        base.erase(std::unique(base.begin(), base.end()), base.end());
+        for (auto row : base) {
+            const WayRow &way_row = section_begin<WayRow>(ways_section)[row];
+            if (!m_changes.count(way_row.way_id)) {
+                func(to_record(way_row));
+            }
+        }
+
+        for (const auto& way_change : m_changes) {
+            for (const auto& record : way_change.second.rows) {
+                if (node_ids.count(record.first_node)
+                        || node_ids.count(record.last_node)) {
+                    func(record);
+                }
+            }
+        }
+    }
+
+    /***
+     * Number of times pass 3 would visit each of the nodes: the visits in
+     * the base corrected by the checked nodes of the changed ways.
+     */
+    std::unordered_map<osmium::object_id_type, int> count_visits(
+            const std::vector<osmium::object_id_type> &node_ids) const {
+        std::unordered_map<osmium::object_id_type, int> visits;
+        for (auto node_id : node_ids) {
+            const VisitRow *visit = std::lower_bound(
+                    section_begin<VisitRow>(visits_section),
+                    section_end<VisitRow>(visits_section), node_id,
+                    [](const VisitRow &row, osmium::object_id_type id) {
+                        return row.node_id < id;
+                    });
+            visits[node_id] = (visit != section_end<VisitRow>(visits_section)
+                               && visit->node_id == node_id)
+                    ? static_cast<int>(visit->visits) : 0;
+        }
+        for (const auto& way_change : m_changes) {
+            const auto nodes = base_checked_nodes(way_change.first);
+            for (const int64_t *node = nodes.first; node != nodes.second;
+                    ++node) {
+                auto visit = visits.find(*node);
+                if (visit != visits.end()) {
+                    --visit->second;
+                }
+            }
+            for (auto node_id : way_change.second.checked_nodes) {
+                auto visit = visits.find(node_id);
+                if (visit != visits.end()) {
+                    ++visit->second;
+                }
+            }
+        }
+        return visits;
+    }
+
+    /***
+     * Write the ways changed since read() to the delta, or the whole state
+     * if the delta got too big.
+     */
+    void write(const std::string &filename) {
+        if (!m_header || delta_too_big()) {
+            write_base(filename);
+        } else {
+            append_delta(filename);
+        }
+    }
+
+    /***
+     * Map the base read only into memory and read the delta.
+     */
+    void read(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open state file " + filename);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) || static_cast<std::size_t>(file_stat.st_size) < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("Not a state file: " + filename);
+        }
+        m_size = file_stat.st_size;
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Failed to map state file " + filename);
+        }
+        m_data = static_cast<const char*>(data);
+        m_header = reinterpret_cast<const Header*>(m_data);
+        if (memcmp(m_header->magic, magic(), sizeof(m_header->magic))) {
+            munmap(const_cast<char*>(m_data), m_size);
+            m_data = nullptr;
+            m_header = nullptr;
+            throw std::runtime_error("Not a state file: " + filename);
+        }
+        if (!valid()) {
+            munmap(const_cast<char*>(m_data), m_size);
+            m_data = nullptr;
+            m_header = nullptr;
+            throw std::runtime_error("State file is truncated or corrupt: "
+                                     + filename);
+        }
+        read_delta(filename);
+    }
+};
+
+#endif /* CHANGESTATE_HPP_ */
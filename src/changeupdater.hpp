@@ -0,0 +1,435 @@
+/***
+ * ChangeUpdater applies an OSM change file to the output and the state of a
+ * previous run (--update):
+ *   - reads the change file, checks it can be applied and refuses it
+ *     otherwise, before anything is written
+ *   - writes the changed nodes into the file based location index
+ *   - replaces the rows of the changed ways in the ways table
+ *   - analyses the end nodes touched by the changed ways again, including
+ *     the false positive checks against way nodes and water polygons
+ * Only the ways and nodes tables are updated. A change file is refused if
+ * it changes a water polygon or a relation of the output, a way of such a
+ * relation or polygon, or moves a node of a geometry the update does not
+ * rebuild. The geometries of a node are found at its old location in the
+ * output, which is why the check runs before the new locations are
+ * written.
+ * Only the rows, checked nodes and visit counts of the changed ways and the
+ * touched nodes are looked up in the state, so the work depends on the
+ * size of the change file, not of the previous run.
+ */
+
+#ifndef CHANGEUPDATER_HPP_
+#define CHANGEUPDATER_HPP_
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "changestate.hpp"
+#include "datastorage.hpp"
+#include "falsepositives.hpp"
+#include "locationindex.hpp"
+#include "tagcheck.hpp"
+#include "waterway.hpp"
+
+
+class ChangeUpdater : public osmium::handler::Handler {
+
+    enum {
+        max_reported_conflicts = 20
+    };
+
+    DataStorage &ds;
+    ChangeState &state;
+    location_handler_type &location_handler;
+    WaterwayCollector &waterway_collector;
+    IndicateFalsePositives &indicate_false_positives;
+
+    /***
+     * Latest version of every changed node and way.
+     */
+    osmium::memory::Buffer m_nodes;
+    std::map<osmium::object_id_type, std::size_t> m_node_offsets;
+    osmium::memory::Buffer m_ways;
+    std::map<osmium::object_id_type, std::size_t> m_way_offsets;
+    std::vector<osmium::object_id_type> m_relation_ids;
+    std::vector<osmium::object_id_type> m_water_relation_ids;
+
+    std::vector<osmium::object_id_type> m_changed_nodes;
+    std::unordered_set<osmium::object_id_type> m_touched_endpoints;
+    std::unordered_set<osmium::object_id_type> m_touched_nodes;
+
+    std::vector<std::string> m_conflicts;
+
+    /***
+     * Keep the latest version of the object in buffer.
+     */
+    template <typename TObject>
+    static void add_latest(osmium::memory::Buffer &buffer,
+                           std::map<osmium::object_id_type, std::size_t> &offsets,
+                           const TObject &object) {
+        auto offset = offsets.find(object.id());
+        if (offset != offsets.end()
+                && buffer.get<TObject>(offset->second).version()
+                   > object.version()) {
+            return;
+        }
+        const std::size_t new_offset = buffer.committed();
+        buffer.add_item(object);
+        buffer.commit();
+        offsets[object.id()] = new_offset;
+    }
+
+    void conflict(const std::string &message) {
+        m_conflicts.push_back(message);
+    }
+
+    /***
+     * The location of the node before the change file, invalid for new
+     * nodes.
+     */
+    osmium::Location old_location(osmium::object_id_type node_id) {
+        try {
+            return location_handler.get_node_location(node_id);
+        } catch (...) {
+            return osmium::Location();
+        }
+    }
+
+    void check_relations() {
+        std::sort(m_relation_ids.begin(), m_relation_ids.end());
+        m_relation_ids.erase(std::unique(m_relation_ids.begin(),
+                                         m_relation_ids.end()),
+                             m_relation_ids.end());
+        std::unordered_set<osmium::object_id_type> output_relations =
+                ds.find_ids("relations", "relation_id", m_relation_ids);
+        const auto relation_polygons =
+                ds.find_ids("polygons", "relation_id", m_relation_ids);
+        output_relations.insert(relation_polygons.begin(),
+                                relation_polygons.end());
+        output_relations.insert(m_water_relation_ids.begin(),
+                                m_water_relation_ids.end());
+        for (auto relation_id : output_relations) {
+            conflict("relation " + std::to_string(relation_id)
+                     + " is a water relation or polygon");
+        }
+    }
+
+    /***
+     * Whether every node of the way with an unchanged location is a vertex
+     * of a relation polygon, then the way is taken as a member of it.
+     */
+    bool in_relation_polygon(const osmium::Way &way) {
+        bool checked = false;
+        for (const auto& node_ref : way.nodes()) {
+            if (m_node_offsets.count(node_ref.ref())) {
+                continue;
+            }
+            const osmium::Location location = old_location(node_ref.ref());
+            if (!location.valid()) {
+                continue;
+            }
+            bool found = false;
+            ds.for_each_row_at(DataStorage::polygons_table, location,
+                    [&found](osmium::object_id_type,
+                             osmium::object_id_type relation_id) {
+                        found = found || relation_id != 0;
+                    });
+            if (!found) {
+                return false;
+            }
+            checked = true;
+        }
+        return checked;
+    }
+
+    void check_ways() {
+        std::vector<osmium::object_id_type> way_ids;
+        for (const auto& entry : m_way_offsets) {
+            way_ids.push_back(entry.first);
+        }
+        for (auto way_id : ds.find_ids("polygons", "way_id", way_ids)) {
+            conflict("way " + std::to_string(way_id) + " is a water polygon");
+        }
+        for (const auto& entry : m_way_offsets) {
+            const osmium::Way &way = m_ways.get<osmium::Way>(entry.second);
+            if (way.visible() && way.nodes().size() > 3 && way.is_closed()
+                    && TagCheck::is_water_area(way)) {
+                conflict("way " + std::to_string(way.id())
+                         + " becomes a water polygon");
+            }
+            for (const auto& record : state.way_rows(way.id())) {
+                if (record.relation_id) {
+                    conflict("way " + std::to_string(way.id())
+                             + " is member of relation "
+                             + std::to_string(record.relation_id));
+                    break;
+                }
+            }
+            if (way.visible() && in_relation_polygon(way)) {
+                conflict("way " + std::to_string(way.id())
+                         + " is member of a water polygon relation");
+            }
+        }
+    }
+
+    /***
+     * A moved node may only be part of the ways rebuilt by the update.
+     */
+    void check_moved_node(const osmium::Node &node) {
+        const osmium::Location location = old_location(node.id());
+        if (!location.valid()
+                || (node.visible() && node.location() == location)) {
+            return;
+        }
+        const std::string prefix = "node " + std::to_string(node.id());
+        ds.for_each_row_at(DataStorage::polygons_table, location,
+                [this, &prefix](osmium::object_id_type way_id,
+                                osmium::object_id_type relation_id) {
+                    conflict(prefix + " of polygon of "
+                             + (way_id ? "way " + std::to_string(way_id)
+                                       : "relation "
+                                         + std::to_string(relation_id))
+                             + " moved");
+                });
+        ds.for_each_row_at(DataStorage::relations_table, location,
+                [this, &prefix](osmium::object_id_type,
+                                osmium::object_id_type relation_id) {
+                    conflict(prefix + " of relation "
+                             + std::to_string(relation_id) + " moved");
+                });
+        ds.for_each_row_at(DataStorage::ways_table, location,
+                [this, &prefix](osmium::object_id_type way_id,
+                                osmium::object_id_type) {
+                    if (!m_way_offsets.count(way_id)) {
+                        conflict(prefix + " of unchanged way "
+                                 + std::to_string(way_id) + " moved");
+                    }
+                });
+    }
+
+    void touch_checked_nodes(osmium::object_id_type way_id) {
+        const std::vector<osmium::object_id_type> checked =
+                state.checked_nodes(way_id);
+        m_touched_nodes.insert(checked.begin(), checked.end());
+    }
+
+    /***
+     * Remove the old rows of the changed ways. check() made sure they are
+     * not member of a relation.
+     */
+    void remove_ways() {
+        std::vector<osmium::object_id_type> way_id_list;
+        for (const auto& entry : m_way_offsets) {
+            way_id_list.push_back(entry.first);
+            touch_checked_nodes(entry.first);
+            for (const auto& record : state.remove_way(entry.first)) {
+                m_touched_endpoints.insert(record.first_node);
+                m_touched_endpoints.insert(record.last_node);
+            }
+        }
+        ds.delete_way_features(way_id_list);
+    }
+
+    bool in_analysed_polygon(osmium::object_id_type node_id) {
+        osmium::Location location;
+        try {
+            location = location_handler.get_node_location(node_id);
+        } catch (...) {
+            std::cerr << "node without location: " << node_id << '\n';
+            return false;
+        }
+        return ds.find_polygon(location,
+                [this](osmium::object_id_type area_id,
+                       const OGRGeometry &geometry, const OGRPoint &point) {
+                    return state.is_analysed_area(area_id)
+                           && geometry.Contains(&point);
+                });
+    }
+
+public:
+
+    ChangeUpdater(DataStorage &data_storage, ChangeState &change_state,
+                  location_handler_type &location_handler,
+                  WaterwayCollector &waterway_collector,
+                  IndicateFalsePositives &indicate_false_positives) :
+            ds(data_storage),
+            state(change_state),
+            location_handler(location_handler),
+            waterway_collector(waterway_collector),
+            indicate_false_positives(indicate_false_positives),
+            m_nodes(1024 * 1024, osmium::memory::Buffer::auto_grow::yes),
+            m_ways(1024 * 1024, osmium::memory::Buffer::auto_grow::yes) {
+        state.sort_areas();
+    }
+
+    /***
+     * The nodes are kept until check() accepted the change file, the
+     * location index still has their old locations until then.
+     */
+    void node(const osmium::Node &node) {
+        add_latest(m_nodes, m_node_offsets, node);
+        m_changed_nodes.push_back(node.id());
+    }
+
+    void way(const osmium::Way &way) {
+        add_latest(m_ways, m_way_offsets, way);
+    }
+
+    void relation(const osmium::Relation &relation) {
+        m_relation_ids.push_back(relation.id());
+        const TagClass tags = TagCheck::classify(relation);
+        if (relation.visible() && (TagCheck::is_waterway(tags, true)
+                                   || TagCheck::is_water_area(tags))) {
+            m_water_relation_ids.push_back(relation.id());
+        }
+    }
+
+    std::size_t changed_ways() const {
+        return m_way_offsets.size();
+    }
+
+    /***
+     * Whether the update can apply the change file. If not, the reasons
+     * are printed and nothing was written.
+     */
+    bool check() {
+        check_relations();
+        check_ways();
+        for (const auto& entry : m_node_offsets) {
+            check_moved_node(m_nodes.get<osmium::Node>(entry.second));
+        }
+        if (m_conflicts.empty()) {
+            return true;
+        }
+        std::sort(m_conflicts.begin(), m_conflicts.end());
+        m_conflicts.erase(std::unique(m_conflicts.begin(), m_conflicts.end()),
+                          m_conflicts.end());
+        for (std::size_t i = 0; i < m_conflicts.size()
+                && i < max_reported_conflicts; ++i) {
+            std::cerr << "Can not update: " << m_conflicts[i] << '\n';
+        }
+        if (m_conflicts.size() > max_reported_conflicts) {
+            std::cerr << "... and " << m_conflicts.size()
+                         - max_reported_conflicts << " more\n";
+        }
+        return false;
+    }
+
+    /***
+     * Write the new locations of the changed nodes into the location index.
+     */
+    void update_locations() {
+        for (const auto& entry : m_node_offsets) {
+            const osmium::Node &node = m_nodes.get<osmium::Node>(entry.second);
+            if (node.visible()) {
+                location_handler.node(node);
+            }
+        }
+    }
+
+    /***
+     * Replace the rows of the changed ways in table ways. Their new rows
+     * are the first entries of the node_map.
+     */
+    void update_ways() {
+        remove_ways();
+
+        for (const auto& entry : m_way_offsets) {
+            osmium::Way &way = m_ways.get<osmium::Way>(entry.second);
+            const TagClass tags = TagCheck::classify(way);
+            if (!way.visible() || way.nodes().empty()) {
+                continue;
+            }
+            location_handler.way(way);
+
+            if (waterway_collector.way_is_valid(tags)) {
+                waterway_collector.create_single_way(way, tags);
+                m_touched_endpoints.insert(way.nodes().front().ref());
+                m_touched_endpoints.insert(way.nodes().back().ref());
+            }
+
+            indicate_false_positives.way(way);
+            touch_checked_nodes(way.id());
+        }
+    }
+
+    /***
+     * Analyse the touched end nodes again and replace their rows in table
+     * nodes. The node_map gets the rows of the state ending at a touched
+     * node, so it holds all ways of these nodes. Like pass 3 every visit of
+     * a way node is one check_node.
+     */
+    void update_nodes() {
+        std::unordered_set<osmium::object_id_type> touched(
+                m_touched_endpoints.begin(), m_touched_endpoints.end());
+        touched.insert(m_touched_nodes.begin(), m_touched_nodes.end());
+        touched.insert(m_changed_nodes.begin(), m_changed_nodes.end());
+
+        std::vector<osmium::object_id_type> node_ids(
+                m_touched_endpoints.begin(), m_touched_endpoints.end());
+        state.for_each_way_at(touched,
+                [this, &touched, &node_ids](const ChangeState::WayRecord &record) {
+                    if (touched.count(record.first_node)) {
+                        node_ids.push_back(record.first_node);
+                    }
+                    if (touched.count(record.last_node)) {
+                        node_ids.push_back(record.last_node);
+                    }
+                    if (!m_way_offsets.count(record.way_id)) {
+                        ds.remember_way(record.first_node, record.last_node,
+                                        record.name, record.type);
+                    }
+                });
+        std::sort(node_ids.begin(), node_ids.end());
+        node_ids.erase(std::unique(node_ids.begin(), node_ids.end()),
+                       node_ids.end());
+        ds.delete_node_features(node_ids);
+
+        for (auto node_id : node_ids) {
+            const EndpointIndex::Group node = ds.node_map.find(node_id);
+            if (!node.empty()) {
+                waterway_collector.analyse_node(node);
+            }
+        }
+
+        std::vector<osmium::object_id_type> error_nodes;
+        for (const auto& error_node : ds.error_map) {
+            error_nodes.push_back(error_node.first);
+        }
+        std::sort(error_nodes.begin(), error_nodes.end());
+        const auto visits = state.count_visits(error_nodes);
+        for (auto node_id : error_nodes) {
+            for (int i = 0; i < visits.at(node_id); ++i) {
+                indicate_false_positives.check_node(node_id);
+            }
+        }
+
+        error_nodes.clear();
+        for (const auto& error_node : ds.error_map) {
+            error_nodes.push_back(error_node.first);
+        }
+        std::sort(error_nodes.begin(), error_nodes.end());
+        for (auto node_id : error_nodes) {
+            if (in_analysed_polygon(node_id)) {
+                indicate_false_positives.check_node(node_id);
+            }
+        }
+
+        ds.insert_error_nodes(location_handler);
+        std::cerr << "Updated " << m_way_offsets.size() << " ways and "
+                  << node_ids.size() << " end nodes\n";
+    }
+};
+
+#endif /* CHANGEUPDATER_HPP_ */
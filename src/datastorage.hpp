@@ -6,31 +6,48 @@
 #define DATASTORAGE_HPP_
 
 #include <math.h>
-#include <geos/index/strtree/STRtree.h>
-#include <geos/index/ItemVisitor.h>
-#include <geos/geom/prep/PreparedPolygon.h>
 
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iomanip>
 #include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include <google/sparse_hash_map>
+#include <osmium/osm/area.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/thread/queue.hpp>
 
 #include <gdalcpp.hpp>
 
-typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type,
-                                  osmium::Location>
-        index_neg_type;
-
-typedef osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type,
-                                           osmium::Location>
-        index_pos_type;
-
-typedef osmium::handler::NodeLocationsForWays<index_pos_type, 
-                                              index_neg_type>
-        location_handler_type;
+#include "changestate.hpp"
+#include "endpointindex.hpp"
+#include "fixedpolygon.hpp"
+#include "hilbert.hpp"
+#include "locationindex.hpp"
+#include "namepool.hpp"
+#include "nodefilter.hpp"
+#include "polygonindex.hpp"
+#include "tagcheck.hpp"
 
 
 class DataStorage {
 public:
+
+    enum table_type {
+        polygons_table,
+        relations_table,
+        ways_table,
+        nodes_table
+    };
+
     /***
      * Structure to remember the waterways according to the firstnodes and
      * lastnodes of the waterways.
@@ -41,91 +58,661 @@ public:
      *  river               = C
      *  other, canal        = ?
      *  >> ignore canals, because can differ in floating direction and size
+     *
+     * The name is an id of the NamePool, equal names have equal ids.
      */
     struct WaterWay {
         osmium::object_id_type first_node;
         osmium::object_id_type last_node;
-        std::string name;
+        uint32_t name_id;
         char category;
+    };
 
-        WaterWay(osmium::object_id_type first_node,
-                 osmium::object_id_type last_node,
-                 const std::string name, const std::string& type) :
-                 first_node(first_node),
-                 last_node(last_node),
-                 name(name) {
-            if (type == "drain" || type == "brook" || type == "ditch") {
-                category = 'A';
-            } else if (type == "stream") {
-                category = 'B';
-            } else if (type == "river") {
-                category = 'C';
-            } else {
-                category = '?';
-            }
+    /***
+     * Number of features inserted into each table and the time spent in
+     * the inserts.
+     */
+    struct InsertStats {
+        std::size_t polygons = 0;
+        std::size_t relations = 0;
+        std::size_t ways = 0;
+        std::size_t nodes = 0;
+        std::chrono::steady_clock::duration insert_time =
+                std::chrono::steady_clock::duration::zero();
+
+        /***
+         * Back-pressure of the writer queue: number of inserts that found
+         * the queue full and the time they waited.
+         */
+        std::size_t queue_full_waits = 0;
+        std::chrono::steady_clock::duration queue_wait_time =
+                std::chrono::steady_clock::duration::zero();
+
+        std::size_t total() const {
+            return polygons + relations + ways + nodes;
         }
     };
 
 private:
+
+    /***
+     * Like gdalcpp::Feature, but works on the OGR layer directly, which can
+     * belong to a dataset created by gdalcpp or opened for update.
+     */
+    class OutputFeature {
+
+        OGRLayer *m_layer;
+        OGRFeature *m_feature;
+
+    public:
+
+        OutputFeature(OGRLayer *layer, std::unique_ptr<OGRGeometry>&& geom) :
+                m_layer(layer),
+                m_feature(OGRFeature::CreateFeature(layer->GetLayerDefn())) {
+            if (!m_feature) {
+                throw std::runtime_error("Failed to create feature");
+            }
+            m_feature->SetGeometryDirectly(geom.release());
+        }
+
+        OutputFeature(const OutputFeature&) = delete;
+        OutputFeature& operator=(const OutputFeature&) = delete;
+
+        ~OutputFeature() {
+            OGRFeature::DestroyFeature(m_feature);
+        }
+
+        void add_to_layer() {
+            if (m_layer->CreateFeature(m_feature) != OGRERR_NONE) {
+                throw std::runtime_error("Failed to add feature to layer");
+            }
+        }
+
+        template <typename TKey, typename TValue>
+        OutputFeature& set_field(TKey key, TValue value) {
+            m_feature->SetField(key, value);
+            return *this;
+        }
+    };
+
+    /***
+     * A row of one of the tables as the handlers create it: the geometry
+     * and the plain attributes, only those of its table are set. The
+     * OGRFeature is built from it where the row is written, so the GDAL
+     * objects are used by the writer thread only.
+     */
+    struct OutputRecord {
+        table_type table;
+        std::unique_ptr<OGRGeometry> geometry;
+        osmium::object_id_type id = 0;
+        osmium::object_id_type relation_id = 0;
+        osmium::object_id_type first_node = 0;
+        osmium::object_id_type last_node = 0;
+        osmium::Timestamp timestamp;
+        std::string type;
+        std::string name;
+        std::string construction;
+        ErrorSum error_sum;
+        bool error = false;
+
+        OutputRecord(table_type table, std::unique_ptr<OGRGeometry>&& geom) :
+                table(table),
+                geometry(std::move(geom)) {
+        }
+    };
+
+    /***
+     * Entry of the writer queue: a record to add, a flush request (done
+     * is set when all records before it are written) or the stop request.
+     */
+    struct WriteTask {
+        std::unique_ptr<OutputRecord> record;
+        std::promise<void> *done = nullptr;
+    };
+
     std::string output_filename;
+    std::size_t m_commit_every;
+    bool m_update_transaction = false;
+    InsertStats m_insert_stats;
     std::vector<WaterWay> m_waterways;
+    NamePool m_names;
+    ChangeState *m_change_state = nullptr;
     osmium::geom::OGRFactory<> m_ogr_factory;
     std::unique_ptr<gdalcpp::Dataset> m_data_source;
-    std::unique_ptr<gdalcpp::Layer> m_layer_polygons;
-    std::unique_ptr<gdalcpp::Layer> m_layer_relations;
-    std::unique_ptr<gdalcpp::Layer> m_layer_ways;
-    std::unique_ptr<gdalcpp::Layer> m_layer_nodes;
+    GDALDataset *m_update_data_source = nullptr;
+    OGRLayer *m_layer_polygons = nullptr;
+    OGRLayer *m_layer_relations = nullptr;
+    OGRLayer *m_layer_ways = nullptr;
+    OGRLayer *m_layer_nodes = nullptr;
+    std::size_t m_write_queue_size = 0;
+    std::unique_ptr<osmium::thread::Queue<WriteTask>> m_write_queue;
+    std::thread m_writer;
 
-    void init_db() {
+    void set_sqlite_options() {
         CPLSetConfigOption("OGR_SQLITE_PRAGMA", "journal_mode=OFF,TEMP_STORE=MEMORY,temp_store=memory,LOCKING_MODE=EXCLUSIVE");
         CPLSetConfigOption("OGR_SQLITE_CACHE", "600");
         CPLSetConfigOption("OGR_SQLITE_JOURNAL", "OFF");
         CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
+    }
+
+    void init_db() {
+        set_sqlite_options();
 
         m_data_source = std::unique_ptr<gdalcpp::Dataset>{new gdalcpp::Dataset("SQlite", output_filename, gdalcpp::SRS(4326), {"SPATIALITE=YES"})};
-        m_layer_polygons = std::unique_ptr<gdalcpp::Layer>{new gdalcpp::Layer(*m_data_source, "polygons", wkbMultiPolygon, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"})};
-        m_layer_relations = std::unique_ptr<gdalcpp::Layer>{new gdalcpp::Layer(*m_data_source, "relations", wkbMultiLineString, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"})};
-        m_layer_ways = std::unique_ptr<gdalcpp::Layer>{new gdalcpp::Layer(*m_data_source, "ways", wkbLineString, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"})};
-        m_layer_nodes = std::unique_ptr<gdalcpp::Layer>{new gdalcpp::Layer(*m_data_source, "nodes", wkbPoint, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"})};
+        if (m_commit_every) {
+            m_data_source->enable_auto_transactions(m_commit_every);
+        }
+        gdalcpp::Layer layer_polygons(*m_data_source, "polygons", wkbMultiPolygon, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"});
+        gdalcpp::Layer layer_relations(*m_data_source, "relations", wkbMultiLineString, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"});
+        gdalcpp::Layer layer_ways(*m_data_source, "ways", wkbLineString, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"});
+        gdalcpp::Layer layer_nodes(*m_data_source, "nodes", wkbPoint, {"SPATIAL_INDEX=NO", "COMPRESS_GEOM=NO"});
 
         /*---- TABLE POLYGONS ----*/
-        m_layer_polygons->add_field("way_id", OFTInteger, 12);
-        m_layer_polygons->add_field("relation_id", OFTInteger, 12);
-        m_layer_polygons->add_field("type", OFTString, 10);
-        m_layer_polygons->add_field("name", OFTString, 30);
-        m_layer_polygons->add_field("lastchange", OFTString, 20);
-        m_layer_polygons->add_field("error", OFTString, 6);
+        layer_polygons.add_field("way_id", OFTInteger, 12);
+        layer_polygons.add_field("relation_id", OFTInteger, 12);
+        layer_polygons.add_field("type", OFTString, 10);
+        layer_polygons.add_field("name", OFTString, 30);
+        layer_polygons.add_field("lastchange", OFTString, 20);
+        layer_polygons.add_field("error", OFTString, 6);
 
         /*---- TABLE RELATIONS ----*/
-        m_layer_relations->add_field("relation_id", OFTInteger, 12);
-        m_layer_relations->add_field("type", OFTString, 10);
-        m_layer_relations->add_field("name", OFTString, 30);
-        m_layer_relations->add_field("lastchange", OFTString, 20);
-        m_layer_relations->add_field("nowaterway_error", OFTString, 6);
-        m_layer_relations->add_field("tagging_error", OFTString, 6);
+        layer_relations.add_field("relation_id", OFTInteger, 12);
+        layer_relations.add_field("type", OFTString, 10);
+        layer_relations.add_field("name", OFTString, 30);
+        layer_relations.add_field("lastchange", OFTString, 20);
+        layer_relations.add_field("nowaterway_error", OFTString, 6);
+        layer_relations.add_field("tagging_error", OFTString, 6);
 
         /*---- TABLE WAYS ----*/
-        m_layer_ways->add_field("way_id", OFTInteger, 12);
-        m_layer_ways->add_field("type", OFTString, 10);
-        m_layer_ways->add_field("name", OFTString, 30);
-        m_layer_ways->add_field("firstnode", OFTString, 11);
-        m_layer_ways->add_field("lastnode", OFTString, 11);
-        m_layer_ways->add_field("relation_id", OFTInteger, 10);
-        m_layer_ways->add_field("width", OFTString, 10);
-        m_layer_ways->add_field("lastchange", OFTString, 20);
-        m_layer_ways->add_field("construction", OFTString, 7);
-        m_layer_ways->add_field("width_error", OFTString, 6);
-        m_layer_ways->add_field("tagging_error", OFTString, 6);
+        layer_ways.add_field("way_id", OFTInteger, 12);
+        layer_ways.add_field("type", OFTString, 10);
+        layer_ways.add_field("name", OFTString, 30);
+        layer_ways.add_field("firstnode", OFTString, 11);
+        layer_ways.add_field("lastnode", OFTString, 11);
+        layer_ways.add_field("relation_id", OFTInteger, 10);
+        layer_ways.add_field("width", OFTString, 10);
+        layer_ways.add_field("lastchange", OFTString, 20);
+        layer_ways.add_field("construction", OFTString, 7);
+        layer_ways.add_field("width_error", OFTString, 6);
+        layer_ways.add_field("tagging_error", OFTString, 6);
 
         /*---- TABLE NODES ----*/
-        m_layer_nodes->add_field("node_id", OFTString, 12);
-        m_layer_nodes->add_field("specific", OFTString, 11);
-        m_layer_nodes->add_field("direction_error", OFTString, 6);
-        m_layer_nodes->add_field("name_error", OFTString, 6);
-        m_layer_nodes->add_field("type_error", OFTString, 6);
-        m_layer_nodes->add_field("spring_error", OFTString, 6);
-        m_layer_nodes->add_field("end_error", OFTString, 6);
-        m_layer_nodes->add_field("way_error", OFTString, 6);
+        layer_nodes.add_field("node_id", OFTString, 12);
+        layer_nodes.add_field("specific", OFTString, 11);
+        layer_nodes.add_field("direction_error", OFTString, 6);
+        layer_nodes.add_field("name_error", OFTString, 6);
+        layer_nodes.add_field("type_error", OFTString, 6);
+        layer_nodes.add_field("spring_error", OFTString, 6);
+        layer_nodes.add_field("end_error", OFTString, 6);
+        layer_nodes.add_field("way_error", OFTString, 6);
+
+        m_layer_polygons = layer_polygons.get();
+        m_layer_relations = layer_relations.get();
+        m_layer_ways = layer_ways.get();
+        m_layer_nodes = layer_nodes.get();
+    }
+
+    /***
+     * Open the tables written by a previous run (--update). gdalcpp only
+     * creates datasets, so without its auto transactions all edits of the
+     * update share one transaction, committed by commit().
+     */
+    void open_db() {
+        set_sqlite_options();
+
+        m_update_data_source = static_cast<GDALDataset*>(GDALOpenEx(
+                output_filename.c_str(), GDAL_OF_VECTOR | GDAL_OF_UPDATE,
+                nullptr, nullptr, nullptr));
+        if (!m_update_data_source) {
+            throw std::runtime_error("Failed to open " + output_filename
+                                     + " for update");
+        }
+        m_layer_polygons = open_layer("polygons");
+        m_layer_relations = open_layer("relations");
+        m_layer_ways = open_layer("ways");
+        m_layer_nodes = open_layer("nodes");
+        if (m_commit_every) {
+            m_update_data_source->StartTransaction();
+            m_update_transaction = true;
+        }
+    }
+
+    OGRLayer *open_layer(const char *name) {
+        OGRLayer *layer = m_update_data_source->GetLayerByName(name);
+        if (!layer) {
+            throw std::runtime_error("Missing table " + std::string(name)
+                                     + " in " + output_filename);
+        }
+        return layer;
+    }
+
+    GDALDataset *data_source() {
+        if (m_update_data_source) {
+            return m_update_data_source;
+        }
+        return m_data_source->get();
+    }
+
+    void exec_sql(const std::string &sql) {
+        flush_writer();
+        OGRLayer *result = data_source()->ExecuteSQL(sql.c_str(), nullptr,
+                                                     nullptr);
+        if (result) {
+            data_source()->ReleaseResultSet(result);
+        }
+    }
+
+    /***
+     * The first column of the first row of the query as string, empty if
+     * the query returned no row.
+     */
+    std::string query_string(const std::string &sql) {
+        flush_writer();
+        std::string value;
+        OGRLayer *result = data_source()->ExecuteSQL(sql.c_str(), nullptr,
+                                                     nullptr);
+        if (result) {
+            if (OGRFeature *feature = result->GetNextFeature()) {
+                value = feature->GetFieldAsString(0);
+                OGRFeature::DestroyFeature(feature);
+            }
+            data_source()->ReleaseResultSet(result);
+        }
+        return value;
+    }
+
+    /***
+     * Delete the rows of table where column is one of the ids, in chunks
+     * to keep the statements short.
+     */
+    void delete_rows(const char *table, const char *column,
+                     const std::vector<osmium::object_id_type> &ids,
+                     bool quote) {
+        const std::size_t chunk_size = 500;
+        for (std::size_t first = 0; first < ids.size(); first += chunk_size) {
+            std::string sql = std::string("DELETE FROM ") + table
+                              + " WHERE " + column + " IN (";
+            const std::size_t last = std::min(first + chunk_size, ids.size());
+            for (std::size_t i = first; i < last; ++i) {
+                if (i != first) {
+                    sql += ',';
+                }
+                if (quote) {
+                    sql += '\'' + std::to_string(ids[i]) + '\'';
+                } else {
+                    sql += std::to_string(ids[i]);
+                }
+            }
+            sql += ')';
+            exec_sql(sql);
+        }
+    }
+
+    static bool has_vertex(const OGRGeometry &geometry, double x, double y) {
+        switch (wkbFlatten(geometry.getGeometryType())) {
+        case wkbPoint: {
+            const OGRPoint &point = static_cast<const OGRPoint&>(geometry);
+            return point.getX() == x && point.getY() == y;
+        }
+        case wkbLineString:
+        case wkbLinearRing: {
+            const OGRLineString &line =
+                    static_cast<const OGRLineString&>(geometry);
+            for (int i = 0; i < line.getNumPoints(); ++i) {
+                if (line.getX(i) == x && line.getY(i) == y) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case wkbPolygon: {
+            const OGRPolygon &polygon =
+                    static_cast<const OGRPolygon&>(geometry);
+            if (polygon.getExteriorRing()
+                    && has_vertex(*polygon.getExteriorRing(), x, y)) {
+                return true;
+            }
+            for (int i = 0; i < polygon.getNumInteriorRings(); ++i) {
+                if (has_vertex(*polygon.getInteriorRing(i), x, y)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case wkbMultiPoint:
+        case wkbMultiLineString:
+        case wkbMultiPolygon:
+        case wkbGeometryCollection: {
+            const OGRGeometryCollection &collection =
+                    static_cast<const OGRGeometryCollection&>(geometry);
+            for (int i = 0; i < collection.getNumGeometries(); ++i) {
+                if (has_vertex(*collection.getGeometryRef(i), x, y)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return false;
+        }
+    }
+
+    static const char *bool2string(bool value) {
+        return value ? "true" : "false";
+    }
+
+    /***
+     * Build the feature of the record for its table and write it.
+     */
+    void write_record(OutputRecord &record) {
+        switch (record.table) {
+        case polygons_table: {
+            OutputFeature feature(m_layer_polygons, std::move(record.geometry));
+            feature.set_field("way_id", static_cast<int>(record.id));
+            feature.set_field("relation_id",
+                              static_cast<int>(record.relation_id));
+            feature.set_field("type", record.type.c_str());
+            if (!record.name.empty()) {
+                feature.set_field("name", record.name.c_str());
+            }
+            feature.set_field("lastchange",
+                              get_timestamp(record.timestamp).c_str());
+            write_feature(feature, m_insert_stats.polygons);
+            break;
+        }
+        case relations_table: {
+            OutputFeature feature(m_layer_relations,
+                                  std::move(record.geometry));
+            feature.set_field("relation_id", static_cast<int>(record.id));
+            feature.set_field("type", record.type.c_str());
+            if (!record.name.empty()) {
+                feature.set_field("name", record.name.c_str());
+            }
+            feature.set_field("lastchange",
+                              get_timestamp(record.timestamp).c_str());
+            feature.set_field("nowaterway_error", bool2string(record.error));
+            write_feature(feature, m_insert_stats.relations);
+            break;
+        }
+        case ways_table: {
+            char first_node_chr[21], last_node_chr[21];
+            sprintf(first_node_chr, "%ld", record.first_node);
+            sprintf(last_node_chr, "%ld", record.last_node);
+
+            OutputFeature feature(m_layer_ways, std::move(record.geometry));
+            feature.set_field(0, static_cast<int>(record.id));
+            feature.set_field(1, record.type.c_str());
+            if (!record.name.empty()) {
+                feature.set_field(2, record.name.c_str());
+            }
+            feature.set_field(3, first_node_chr);
+            feature.set_field(4, last_node_chr);
+            feature.set_field(5, static_cast<int>(record.relation_id));
+            feature.set_field("lastchange",
+                              get_timestamp(record.timestamp).c_str());
+            feature.set_field("construction", record.construction.c_str());
+            feature.set_field("width_error", bool2string(record.error));
+            write_feature(feature, m_insert_stats.ways);
+            break;
+        }
+        case nodes_table: {
+            const ErrorSum &sum = record.error_sum;
+            char id_chr[21];
+            sprintf(id_chr, "%ld", record.id);
+
+            OutputFeature feature(m_layer_nodes, std::move(record.geometry));
+            feature.set_field("node_id", id_chr);
+            if (sum.is_rivermouth()) feature.set_field("specific", "rivermouth");
+            else feature.set_field("specific", (sum.is_outflow()) ? "outflow": "");
+            feature.set_field("direction_error",
+                              bool2string(sum.is_direction_error()));
+            feature.set_field("name_error", bool2string(sum.is_name_error()));
+            feature.set_field("type_error", bool2string(sum.is_type_error()));
+            feature.set_field("spring_error",
+                              bool2string(sum.is_spring_error()));
+            feature.set_field("end_error", bool2string(sum.is_end_error()));
+            feature.set_field("way_error", bool2string(sum.is_way_error()));
+            write_feature(feature, m_insert_stats.nodes);
+            break;
+        }
+        }
+    }
+
+    /***
+     * OutputFeature bypasses gdalcpp::Feature, so the edit is announced to
+     * the auto transactions of the gdalcpp::Dataset here.
+     */
+    void write_feature(OutputFeature &feature, std::size_t &counter) {
+        const auto start = std::chrono::steady_clock::now();
+        if (m_data_source) {
+            m_data_source->prepare_edit();
+            feature.add_to_layer();
+            m_data_source->finalize_edit();
+        } else {
+            feature.add_to_layer();
+        }
+        ++counter;
+        m_insert_stats.insert_time += std::chrono::steady_clock::now() - start;
+    }
+
+    /***
+     * Commit the pending edits. gdalcpp commits only if there are any and
+     * starts the next transaction with the next edit.
+     */
+    void commit_transaction() {
+        if (m_data_source) {
+            m_data_source->disable_auto_transactions();
+            if (m_commit_every) {
+                m_data_source->enable_auto_transactions(m_commit_every);
+            }
+        } else if (m_update_transaction) {
+            m_update_data_source->CommitTransaction();
+            m_update_transaction = false;
+        }
+    }
+
+    /***
+     * Hand the record to the writer thread if it runs, otherwise write it
+     * directly.
+     */
+    void add_to_layer(std::unique_ptr<OutputRecord> &&record) {
+        if (!m_writer.joinable()) {
+            write_record(*record);
+            return;
+        }
+        WriteTask task;
+        task.record = std::move(record);
+        push_task(std::move(task));
+    }
+
+    void push_task(WriteTask &&task) {
+        if (m_write_queue->size() < m_write_queue_size) {
+            m_write_queue->push(std::move(task));
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        m_write_queue->push(std::move(task));
+        ++m_insert_stats.queue_full_waits;
+        m_insert_stats.queue_wait_time += std::chrono::steady_clock::now()
+                                          - start;
+    }
+
+    /***
+     * Runs in the writer thread, the only thread using the dataset while
+     * it runs. Other threads access the dataset after flush_writer().
+     */
+    void run_writer() {
+        while (true) {
+            WriteTask task;
+            m_write_queue->wait_and_pop(task);
+            if (task.record) {
+                try {
+                    write_record(*task.record);
+                } catch (std::runtime_error& err) {
+                    std::cerr << err.what() << '\n';
+                }
+            } else if (task.done) {
+                task.done->set_value();
+            } else {
+                return;
+            }
+        }
+    }
+
+    /***
+     * Wait until the writer thread wrote all queued features.
+     */
+    void flush_writer() {
+        if (!m_writer.joinable()) {
+            return;
+        }
+        std::promise<void> done;
+        std::future<void> written = done.get_future();
+        WriteTask task;
+        task.done = &done;
+        push_task(std::move(task));
+        written.get();
+    }
+
+    void stop_writer() {
+        if (!m_writer.joinable()) {
+            return;
+        }
+        flush_writer();
+        m_write_queue->push(WriteTask());
+        m_writer.join();
+        m_write_queue.reset();
+    }
+
+    /***
+     * Columns the layers of map/water.map filter on and the id columns the
+     * update mode deletes and looks up by.
+     */
+    static std::vector<std::string> index_columns(const std::string &table) {
+        if (table == "ways") {
+            return {"way_id", "type", "construction"};
+        } else if (table == "nodes") {
+            return {"node_id", "specific"};
+        } else if (table == "polygons") {
+            return {"way_id", "relation_id", "type"};
+        }
+        return {"relation_id", "type"};
+    }
+
+    /***
+     * Feature ids of the layer and the Hilbert index of the centre of their
+     * bounding boxes.
+     */
+    static std::vector<std::pair<uint64_t, GIntBig>> read_hilbert_keys(
+            OGRLayer *layer) {
+        std::vector<std::pair<uint64_t, GIntBig>> keys;
+        layer->ResetReading();
+        while (OGRFeature *feature = layer->GetNextFeature()) {
+            uint64_t key = 0;
+            const OGRGeometry *geometry = feature->GetGeometryRef();
+            if (geometry && !geometry->IsEmpty()) {
+                OGREnvelope envelope;
+                geometry->getEnvelope(&envelope);
+                key = Hilbert::index(osmium::Location(
+                        (envelope.MinX + envelope.MaxX) / 2,
+                        (envelope.MinY + envelope.MaxY) / 2));
+            }
+            keys.emplace_back(key, feature->GetFID());
+            OGRFeature::DestroyFeature(feature);
+        }
+        return keys;
+    }
+
+    /***
+     * SpatiaLite name of the geometry type of the layers.
+     */
+    static const char *spatialite_type(OGRwkbGeometryType type) {
+        switch (wkbFlatten(type)) {
+        case wkbPoint:
+            return "POINT";
+        case wkbLineString:
+            return "LINESTRING";
+        case wkbMultiLineString:
+            return "MULTILINESTRING";
+        case wkbMultiPolygon:
+            return "MULTIPOLYGON";
+        default:
+            return "GEOMETRY";
+        }
+    }
+
+    /***
+     * Rewrite the rows of the layer in the order of fids, so rows close in
+     * space are stored close in the file. The rows are copied once, into a
+     * table created with the schema of the layer, which then replaces it.
+     * CREATE TABLE AS SELECT would lose the INTEGER PRIMARY KEY, without it
+     * VACUUM renumbers the rows and the spatial index goes stale. The new
+     * fids are the positions in the order, so the primary key order is the
+     * Hilbert order. The order is staged in a table of the output file, not
+     * in the temporary storage, which is kept in memory.
+     */
+    void rewrite_in_order(OGRLayer *layer, const std::vector<GIntBig> &fids) {
+        const std::string table = layer->GetName();
+        const std::string sorted = table + "_sorted";
+        const std::string geometry_column = layer->GetGeometryColumn();
+        const std::string fid_column = std::string("\"")
+                                       + layer->GetFIDColumn() + '"';
+        const char *geometry_type = spatialite_type(layer->GetGeomType());
+        std::string columns = '"' + geometry_column + '"';
+        std::string table_columns = "t." + columns;
+        OGRFeatureDefn *defn = layer->GetLayerDefn();
+        for (int i = 0; i < defn->GetFieldCount(); ++i) {
+            const std::string column = std::string("\"")
+                    + defn->GetFieldDefn(i)->GetNameRef() + '"';
+            columns += ',' + column;
+            table_columns += ",t." + column;
+        }
+        layer->ResetReading();
+        const std::string create_table = query_string(
+                "SELECT sql FROM sqlite_master WHERE type = 'table' AND "
+                "name = '" + table + "'");
+        const std::size_t definition = create_table.find('(');
+        if (definition == std::string::npos) {
+            std::cerr << "Failed to read the schema of table " << table
+                      << ", its rows are not sorted\n";
+            return;
+        }
+
+        data_source()->StartTransaction();
+        exec_sql("CREATE TABLE finalize_order "
+                 "(position INTEGER PRIMARY KEY, fid INTEGER)");
+        const std::size_t chunk_size = 500;
+        for (std::size_t first = 0; first < fids.size(); first += chunk_size) {
+            std::string sql = "INSERT INTO finalize_order (fid) VALUES ";
+            const std::size_t last = std::min(first + chunk_size, fids.size());
+            for (std::size_t i = first; i < last; ++i) {
+                if (i != first) {
+                    sql += ',';
+                }
+                sql += '(' + std::to_string(fids[i]) + ')';
+            }
+            exec_sql(sql);
+        }
+        exec_sql("CREATE TABLE " + sorted + ' '
+                 + create_table.substr(definition));
+        exec_sql("INSERT INTO " + sorted + " (" + fid_column + ',' + columns
+                 + ") SELECT o.position," + table_columns
+                 + " FROM finalize_order o "
+                 "CROSS JOIN " + table + " t ON t." + fid_column + " = o.fid "
+                 "ORDER BY o.position");
+        exec_sql("DROP TABLE finalize_order");
+        exec_sql("SELECT DiscardGeometryColumn('" + table + "', '"
+                 + geometry_column + "')");
+        exec_sql("DROP TABLE " + table);
+        exec_sql("ALTER TABLE " + sorted + " RENAME TO " + table);
+        const std::string recovered = query_string(
+                "SELECT RecoverGeometryColumn('" + table + "', '"
+                + geometry_column + "', 4326, '" + geometry_type + "', 'XY')");
+        data_source()->CommitTransaction();
+        if (recovered != "1") {
+            std::cerr << "Failed to register the geometry column of table "
+                      << table << '\n';
+        }
     }
 
     const std::string get_timestamp(osmium::Timestamp timestamp) {
@@ -135,12 +722,13 @@ private:
         return time_str;
     }
 
+public:
     /***
      * Get width as float in meter from the common formats. Detect errors
      * within the width string.
      * A ',' as separator dedicates an erroror, but is handled.
      */
-    bool get_width(const char *width_chr, float &width) {
+    static bool get_width(const char *width_chr, float &width) {
         if (!width_chr) {
             width = 0;
             return false;
@@ -190,6 +778,8 @@ private:
         return error;
     }
 
+private:
+
     std::string width2string(float &width) {
         int rounded_width = static_cast<int> (round(width * 10));
         std::string width_str = std::to_string(rounded_width);
@@ -200,46 +790,353 @@ private:
         return width_str;
     }
 
-    void remember_way(osmium::object_id_type first_node,
-                      osmium::object_id_type last_node,
-                      const std::string name, const std::string& type) {
-        m_waterways.emplace_back(first_node, last_node, std::move(name), type);
-        size_t last_idx = m_waterways.size() - 1;
-        node_map[first_node].push_back(last_idx);
-        node_map[last_node].push_back(last_idx);
-    }
-
 public:
     /***
      * node_map: Contains all first_nodes and last_nodes of found waterways with
-     * the names and categories of the connected ways.
+     * the indexes of the connected ways, sorted once before the analysis.
      * error_map: Contains ids of the potential error nodes (or mouths) to be
-     * checked in pass 3.
+     * checked in pass 3. Add them with add_error_node().
+     * error_filter: Bloom filter of the error_map ids, erased ids stay in it.
      * error_tree: The potential error nodes remaining after pass 3 are stored
      * in here for a geometrical analysis in pass 5.
-     * polygon_tree: contains prepared polygons of all water polygons except of
-     * riverbanks found in pass 4. 
+     * polygon_tree: contains the indexes into fixed_polygon_set of all water
+     * polygons except of riverbanks found in pass 4.
      */
-    google::sparse_hash_map<osmium::object_id_type, std::vector<std::size_t>> node_map;
-    google::sparse_hash_map<osmium::object_id_type, ErrorSum*> error_map;
-    std::vector<std::unique_ptr<geos::geom::prep::PreparedPolygon>> prepared_polygon_set;
-    std::vector<std::unique_ptr<geos::geom::MultiPolygon>> multipolygon_set;
-    geos::index::strtree::STRtree polygon_tree;
+    EndpointIndex node_map;
+    google::sparse_hash_map<osmium::object_id_type, ErrorSum> error_map;
+    NodeFilter error_filter;
+    std::vector<FixedPolygon> fixed_polygon_set;
+    PolygonIndex polygon_tree;
 
-    explicit DataStorage(std::string outfile) :
+    /***
+     * With update the tables of outfile are opened instead of creating a
+     * new database.
+     */
+    explicit DataStorage(std::string outfile,
+                         std::size_t commit_every = 10000,
+                         bool update = false) :
             output_filename(outfile),
+            m_commit_every(commit_every),
             m_waterways(),
             m_ogr_factory() {
-        init_db();
-        node_map.set_deleted_key(-1);
+        if (update) {
+            open_db();
+        } else {
+            init_db();
+        }
         error_map.set_deleted_key(-1);
     }
 
+    ~DataStorage() {
+        stop_writer();
+        try {
+            commit();
+        } catch (...) {
+            std::cerr << "Failed to commit the last transaction\n";
+        }
+        if (m_update_data_source) {
+            GDALClose(m_update_data_source);
+        }
+    }
+
+    /***
+     * Commit the open transaction. Must be called before the output is
+     * used.
+     */
+    void commit() {
+        flush_writer();
+        commit_transaction();
+    }
+
+    /***
+     * Add the features from a writer thread with a queue of queue_size
+     * records, so building the features and the inserts overlap with
+     * reading and analysing the input. The features are written in the
+     * order they are inserted.
+     */
+    void start_writer(std::size_t queue_size) {
+        if (m_writer.joinable() || queue_size == 0) {
+            return;
+        }
+        m_write_queue_size = queue_size;
+        m_write_queue.reset(new osmium::thread::Queue<WriteTask>(queue_size,
+                                                                 "writer"));
+        m_writer = std::thread(&DataStorage::run_writer, this);
+    }
+
+    /***
+     * Finalize the output after the last insert: store the rows of every
+     * table in Hilbert order of their geometries, then build the spatial
+     * indexes and the attribute indexes and VACUUM the file to drop the
+     * pages of the replaced tables. The tables are created without indexes
+     * to keep the bulk load fast. SQLite has a single writer, so the tables
+     * are rewritten and indexed one after the other; only the sort keys are
+     * sorted in the pool meanwhile.
+     */
+    void finalize(osmium::thread::Pool &pool) {
+        commit();
+        typedef std::vector<std::pair<uint64_t, GIntBig>> keys_type;
+        const std::vector<OGRLayer*> layers {m_layer_polygons,
+                m_layer_relations, m_layer_ways, m_layer_nodes};
+
+        std::vector<std::future<std::vector<GIntBig>>> orders;
+        for (auto layer : layers) {
+            std::shared_ptr<keys_type> keys = std::make_shared<keys_type>(
+                    read_hilbert_keys(layer));
+            orders.push_back(pool.submit([keys] {
+                std::sort(keys->begin(), keys->end());
+                std::vector<GIntBig> fids;
+                fids.reserve(keys->size());
+                for (const auto& key : *keys) {
+                    fids.push_back(key.second);
+                }
+                return fids;
+            }));
+        }
+
+        for (std::size_t i = 0; i < layers.size(); ++i) {
+            OGRLayer *layer = layers[i];
+            const std::string table = layer->GetName();
+            rewrite_in_order(layer, orders[i].get());
+            exec_sql("SELECT CreateSpatialIndex('" + table + "', '"
+                     + layer->GetGeometryColumn() + "')");
+            for (const auto& column : index_columns(table)) {
+                exec_sql("CREATE INDEX IF NOT EXISTS " + table + '_' + column
+                         + " ON " + table + " (\"" + column + "\")");
+            }
+        }
+        // The copy VACUUM builds does not fit into the memory the
+        // temporary storage is kept in.
+        exec_sql("PRAGMA temp_store = FILE");
+        exec_sql("VACUUM");
+    }
+
+    const InsertStats& insert_stats() {
+        flush_writer();
+        return m_insert_stats;
+    }
+
+    void report_insert_stats(std::ostream &out) {
+        flush_writer();
+        double seconds = std::chrono::duration<double>(
+                m_insert_stats.insert_time).count();
+        out << "Inserted features: " << m_insert_stats.polygons
+            << " polygons, " << m_insert_stats.relations << " relations, "
+            << m_insert_stats.ways << " ways, " << m_insert_stats.nodes
+            << " nodes in " << std::fixed << std::setprecision(2)
+            << seconds << "s";
+        if (seconds > 0) {
+            out << " (" << static_cast<std::size_t>(
+                    m_insert_stats.total() / seconds) << " features/s)";
+        }
+        out << '\n';
+        if (m_insert_stats.queue_full_waits) {
+            out << "Writer queue full " << m_insert_stats.queue_full_waits
+                << " times, waited " << std::chrono::duration<double>(
+                        m_insert_stats.queue_wait_time).count() << "s\n";
+        }
+    }
+
+    /***
+     * Insert or replace node_id in the error_map and the error_filter.
+     */
+    void add_error_node(osmium::object_id_type node_id, const ErrorSum &sum) {
+        error_map[node_id] = sum;
+        if (error_filter.full()) {
+            error_filter.resize(error_map.size() * 2);
+            for (const auto& node : error_map) {
+                error_filter.add(node.first);
+            }
+        } else {
+            error_filter.add(node_id);
+        }
+    }
+
+    /***
+     * False if node_id is not in the error_map, saves the hash lookup for
+     * most nodes.
+     */
+    bool may_be_error_node(osmium::object_id_type node_id) const {
+        return error_filter.may_contain(node_id);
+    }
+
     WaterWay& get_waterway(const size_t offset) {
         return m_waterways.at(offset);
     }
 
-    void insert_polygon_feature(std::unique_ptr<OGRMultiPolygon>&& geom, const osmium::Area &area) {
+    void remember_way(osmium::object_id_type first_node,
+                      osmium::object_id_type last_node,
+                      const std::string &name, const std::string &type) {
+        m_waterways.push_back(WaterWay{first_node, last_node,
+                m_names.intern(name),
+                TagCheck::get_waterway_category(type.c_str())});
+        size_t last_idx = m_waterways.size() - 1;
+        const uint64_t closed = (first_node == last_node)
+                ? EndpointIndex::role_first | EndpointIndex::role_last : 0;
+        node_map.add(first_node, last_idx,
+                     EndpointIndex::role_first | closed);
+        node_map.add(last_node, last_idx, EndpointIndex::role_last | closed);
+    }
+
+    /***
+     * Replace the waterways and their names with those of a snapshot
+     * (--resume), node_map is restored separately.
+     */
+    void restore_waterways(const WaterWay *begin, const WaterWay *end,
+                           const char *names, std::size_t names_size) {
+        static_assert(std::is_trivially_copyable<WaterWay>::value,
+                      "WaterWay is stored in snapshots as it is");
+        m_waterways.assign(begin, end);
+        m_names.assign(names, names_size);
+    }
+
+    const std::vector<WaterWay>& waterways() const {
+        return m_waterways;
+    }
+
+    const NamePool& names() const {
+        return m_names;
+    }
+
+    /***
+     * Record the rows of the ways table, the checked way nodes and the
+     * analysed polygons into state (--state).
+     */
+    void record_change_state(ChangeState &state) {
+        m_change_state = &state;
+    }
+
+    ChangeState *change_state() {
+        return m_change_state;
+    }
+
+    /***
+     * Update mode: remove the rows of changed ways and nodes before they
+     * are inserted again.
+     */
+    void delete_way_features(const std::vector<osmium::object_id_type> &way_ids) {
+        delete_rows("ways", "way_id", way_ids, false);
+    }
+
+    void delete_node_features(const std::vector<osmium::object_id_type> &node_ids) {
+        delete_rows("nodes", "node_id", node_ids, true);
+    }
+
+    /***
+     * Resume from a stage 2 snapshot: the end nodes of the interrupted run
+     * are analysed again, only the way errors of pass 2 are kept.
+     */
+    void delete_analysed_node_features() {
+        exec_sql("DELETE FROM nodes WHERE way_error <> 'true'");
+    }
+
+    /***
+     * Call func(area_id, geometry) for the rows of the polygons table whose
+     * bounding box contains the location until func returns true. Used by
+     * the update mode, where the polygon tree is not built.
+     */
+    template <typename TFunc>
+    bool find_polygon(const osmium::Location &location, TFunc &&func) {
+        flush_writer();
+        OGRPoint point(location.lon(), location.lat());
+        m_layer_polygons->SetSpatialFilter(&point);
+        m_layer_polygons->ResetReading();
+        bool found = false;
+        while (!found) {
+            OGRFeature *feature = m_layer_polygons->GetNextFeature();
+            if (!feature) {
+                break;
+            }
+            const osmium::object_id_type way_id =
+                    feature->GetFieldAsInteger("way_id");
+            const osmium::object_id_type relation_id =
+                    feature->GetFieldAsInteger("relation_id");
+            const osmium::object_id_type area_id = way_id
+                    ? osmium::object_id_to_area_id(way_id, osmium::item_type::way)
+                    : osmium::object_id_to_area_id(relation_id, osmium::item_type::relation);
+            OGRGeometry *geometry = feature->GetGeometryRef();
+            if (geometry) {
+                found = func(area_id, *geometry, point);
+            }
+            OGRFeature::DestroyFeature(feature);
+        }
+        m_layer_polygons->SetSpatialFilter(nullptr);
+        return found;
+    }
+
+    /***
+     * Those of ids found in column of table, queried in chunks like
+     * delete_rows().
+     */
+    std::unordered_set<osmium::object_id_type> find_ids(const char *table,
+            const char *column,
+            const std::vector<osmium::object_id_type> &ids) {
+        flush_writer();
+        std::unordered_set<osmium::object_id_type> found;
+        const std::size_t chunk_size = 500;
+        for (std::size_t first = 0; first < ids.size(); first += chunk_size) {
+            std::string sql = std::string("SELECT ") + column + " FROM "
+                              + table + " WHERE " + column + " IN (";
+            const std::size_t last = std::min(first + chunk_size, ids.size());
+            for (std::size_t i = first; i < last; ++i) {
+                if (i != first) {
+                    sql += ',';
+                }
+                sql += std::to_string(ids[i]);
+            }
+            sql += ')';
+            OGRLayer *result = data_source()->ExecuteSQL(sql.c_str(), nullptr,
+                                                         nullptr);
+            if (!result) {
+                continue;
+            }
+            while (OGRFeature *feature = result->GetNextFeature()) {
+                found.insert(feature->GetFieldAsInteger64(0));
+                OGRFeature::DestroyFeature(feature);
+            }
+            data_source()->ReleaseResultSet(result);
+        }
+        return found;
+    }
+
+    /***
+     * Call func(way_id, relation_id) for every row of the polygons,
+     * relations or ways table with a vertex at location. The update mode
+     * uses it to find the geometries containing a node, the coordinates
+     * are compared exactly because both come from the same fixed point
+     * location.
+     */
+    template <typename TFunc>
+    void for_each_row_at(table_type table, const osmium::Location &location,
+                         TFunc &&func) {
+        flush_writer();
+        OGRLayer *layer = table == polygons_table ? m_layer_polygons
+                          : table == relations_table ? m_layer_relations
+                          : m_layer_ways;
+        const int way_id_field =
+                layer->GetLayerDefn()->GetFieldIndex("way_id");
+        const int relation_id_field =
+                layer->GetLayerDefn()->GetFieldIndex("relation_id");
+        OGRPoint point(location.lon(), location.lat());
+        layer->SetSpatialFilter(&point);
+        layer->ResetReading();
+        while (OGRFeature *feature = layer->GetNextFeature()) {
+            const OGRGeometry *geometry = feature->GetGeometryRef();
+            if (geometry && has_vertex(*geometry, point.getX(),
+                                       point.getY())) {
+                func(way_id_field < 0 ? 0
+                     : feature->GetFieldAsInteger64(way_id_field),
+                     relation_id_field < 0 ? 0
+                     : feature->GetFieldAsInteger64(relation_id_field));
+            }
+            OGRFeature::DestroyFeature(feature);
+        }
+        layer->SetSpatialFilter(nullptr);
+    }
+
+    void insert_polygon_feature(std::unique_ptr<OGRMultiPolygon>&& geom,
+                                const osmium::Area &area,
+                                const TagClass &tags) {
         osmium::object_id_type way_id;
         osmium::object_id_type relation_id;
         if (area.from_way()) {
@@ -250,96 +1147,73 @@ public:
             relation_id = area.orig_id();
         }
 
-        const std::string type = TagCheck::get_polygon_type(area);
-        const char* name = area.get_value_by_key("name");
-
-        try {
-            gdalcpp::Feature feature(*m_layer_polygons, std::move(geom));
-            feature.set_field("way_id", static_cast<int>(way_id));
-            feature.set_field("relation_id", static_cast<int>(relation_id));
-            feature.set_field("type", type.c_str());
-            if (name) {
-                feature.set_field("name", name);
-            }
-            feature.set_field("lastchange",
-                              get_timestamp(area.timestamp()).c_str());
-            feature.add_to_layer();
-        } catch (osmium::geometry_error& err) {
-            std::cerr << "Failed to create geometry feature for polygon of ";
-            if (area.from_way()) std::cerr << "way: ";
-            else std::cerr << "relation: ";
-            std::cerr << area.orig_id() << '\n';
+        std::unique_ptr<OutputRecord> record(
+                new OutputRecord(polygons_table, std::move(geom)));
+        record->id = way_id;
+        record->relation_id = relation_id;
+        record->type = TagCheck::get_polygon_type(tags);
+        if (tags.name) {
+            record->name = tags.name;
         }
+        record->timestamp = area.timestamp();
+        add_to_layer(std::move(record));
     }
 
     void insert_relation_feature(std::unique_ptr<OGRGeometry>&& geom,
                                  const osmium::Relation &relation,
+                                 const TagClass &tags,
                                  bool contains_nowaterway) {
-        const std::string type = TagCheck::get_way_type(relation);
-        const char *name = relation.get_value_by_key("name");
-
-        try {
-            gdalcpp::Feature feature(*m_layer_relations, std::move(geom));
-            feature.set_field("relation_id", static_cast<int>(relation.id()));
-            feature.set_field("type", type.c_str());
-            if (name) {
-                feature.set_field("name", name);
-            }
-            feature.set_field("lastchange",
-                              get_timestamp(relation.timestamp()).c_str());
-            if (contains_nowaterway)
-                feature.set_field("nowaterway_error", "true");
-            else
-                feature.set_field("nowaterway_error", "false");
-            feature.add_to_layer();
-        } catch (osmium::geometry_error& err) {
-            std::cerr << "Failed to create relation feature:" << err.what() << "\n";
+        std::unique_ptr<OutputRecord> record(
+                new OutputRecord(relations_table, std::move(geom)));
+        record->id = relation.id();
+        record->type = TagCheck::get_way_type(tags);
+        if (tags.name) {
+            record->name = tags.name;
         }
+        record->timestamp = relation.timestamp();
+        record->error = contains_nowaterway;
+        add_to_layer(std::move(record));
     }
 
     void insert_way_feature(std::unique_ptr<OGRGeometry>&& geom,
                             const osmium::Way &way,
+                            const TagClass &tags,
                             osmium::object_id_type rel_id) {
-        const std::string type = TagCheck::get_way_type(way);
-        const char *width = TagCheck::get_width(way);
-        const std::string construction = TagCheck::get_construction(way);
-        const std::string name {way.get_value_by_key("name", "")};
+        const std::string type = TagCheck::get_way_type(tags);
+        const char *width = TagCheck::get_width(tags);
+        const std::string construction = TagCheck::get_construction(tags);
+        const std::string name {tags.name ? tags.name : ""};
 
         bool width_err;
         float w = 0;
         width_err = get_width(width, w);
 
-        char first_node_chr[13], last_node_chr[13];
         osmium::object_id_type first_node = way.nodes().cbegin()->ref();
         osmium::object_id_type last_node = way.nodes().crbegin()->ref();
-        sprintf(first_node_chr, "%ld", first_node);
-        sprintf(last_node_chr, "%ld", last_node);
 
-        try {
-            gdalcpp::Feature feature(*m_layer_ways, std::move(geom));
-            feature.set_field(0, static_cast<int>(way.id()));
-            feature.set_field(1, type.c_str());
-            if (!name.empty()) {
-                feature.set_field(2, name.c_str());
-            }
-            feature.set_field(3, first_node_chr);
-            feature.set_field(4, last_node_chr);
-            feature.set_field(5, static_cast<int>(rel_id));
-            feature.set_field("lastchange", get_timestamp(way.timestamp()).c_str());
-            feature.set_field("construction", construction.c_str());
-            feature.set_field("width_error", (width_err) ? "true" : "false");
-            feature.add_to_layer();
-        } catch (osmium::geometry_error& err) {
-            std::cerr << "Failed to create geometry feature for way: "
-                 << way.id() << '\n';
-        }
+        std::unique_ptr<OutputRecord> record(
+                new OutputRecord(ways_table, std::move(geom)));
+        record->id = way.id();
+        record->relation_id = rel_id;
+        record->first_node = first_node;
+        record->last_node = last_node;
+        record->type = type;
+        record->name = name;
+        record->timestamp = way.timestamp();
+        record->construction = construction;
+        record->error = width_err;
+        add_to_layer(std::move(record));
 
-        remember_way(first_node, last_node, std::move(name), type);
+        if (m_change_state) {
+            m_change_state->add_way(way.id(), rel_id, first_node, last_node,
+                                    name, type);
+        }
+        remember_way(first_node, last_node, name, type);
     }
 
     void insert_node_feature(osmium::Location location,
                              osmium::object_id_type node_id,
-                             ErrorSum *sum) {
+                             const ErrorSum &sum) {
         std::unique_ptr<OGRPoint> point;
         try {
             point = m_ogr_factory.create_point(location);
@@ -352,28 +1226,11 @@ public:
             return;
         }
 
-        gdalcpp::Feature feature {*m_layer_nodes, std::move(point)};
-
-        char id_chr[12];
-        sprintf(id_chr, "%ld", node_id);
-
-        feature.set_field("node_id", id_chr);
-        if (sum->is_rivermouth()) feature.set_field("specific", "rivermouth");
-        else feature.set_field("specific", (sum->is_outflow()) ? "outflow": "");
-        feature.set_field("direction_error",
-                          (sum->is_direction_error()) ? "true" : "false");
-        feature.set_field("name_error",
-                          (sum->is_name_error()) ? "true" : "false");
-        feature.set_field("type_error",
-                          (sum->is_type_error()) ? "true" : "false");
-        feature.set_field("spring_error",
-                          (sum->is_spring_error()) ? "true" : "false");
-        feature.set_field("end_error",
-                          (sum->is_end_error()) ? "true" : "false");
-        feature.set_field("way_error",
-                          (sum->is_way_error()) ? "true" : "false");
-        feature.add_to_layer();
-
+        std::unique_ptr<OutputRecord> record(
+                new OutputRecord(nodes_table, std::move(point)));
+        record->id = node_id;
+        record->error_sum = sum;
+        add_to_layer(std::move(record));
     }
 
 //    /***
@@ -407,12 +1264,11 @@ public:
      */
     void insert_error_nodes(location_handler_type &location_handler) {
         osmium::Location location;
-        for (auto node : error_map) {
-            node.second->switch_poss();
+        for (auto& node : error_map) {
+            node.second.switch_poss();
             osmium::object_id_type node_id = node.first;
             location = location_handler.get_node_location(node_id);
             insert_node_feature(location, node_id, node.second);
-            delete node.second;
         }
     }
 };
@@ -0,0 +1,539 @@
+/***
+ * EndpointIndex maps the first and last nodes of the waterways to the
+ * indexes of the waterways.
+ *
+ * The entries are appended to one flat array while the ways are read and
+ * radix sorted in place by node id before the first lookup, so the ways of
+ * a node are one contiguous group. Every entry stores the way index together with
+ * the role of the node in the way (first node, last node or both).
+ *
+ * With a memory limit (--memory-limit) the entries are sorted in place and
+ * spilled into a temporary file whenever the limit is reached. The entry
+ * buffer is allocated once with the size of the limit and no sort buffer
+ * is needed, so the entries never take more memory than the limit.
+ * for_each_group() then merges these runs and the entries in memory,
+ * find() and the iterators only work while nothing is spilled.
+ */
+
+#ifndef ENDPOINTINDEX_HPP_
+#define ENDPOINTINDEX_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <osmium/osm/types.hpp>
+
+
+class EndpointIndex {
+
+public:
+
+    enum role_type : uint64_t {
+        role_first = 1,
+        role_last = 2
+    };
+
+    struct Entry {
+        osmium::object_id_type node_id;
+        uint64_t value;
+
+        std::size_t way_index() const {
+            return static_cast<std::size_t>(value >> 2);
+        }
+
+        bool is_first() const {
+            return value & role_first;
+        }
+
+        bool is_last() const {
+            return value & role_last;
+        }
+    };
+
+    /***
+     * All entries of one node.
+     */
+    class Group {
+
+        const Entry *m_begin;
+        const Entry *m_end;
+
+    public:
+
+        Group(const Entry *begin, const Entry *end) :
+                m_begin(begin),
+                m_end(end) {
+        }
+
+        osmium::object_id_type node_id() const {
+            return m_begin->node_id;
+        }
+
+        const Entry *begin() const {
+            return m_begin;
+        }
+
+        const Entry *end() const {
+            return m_end;
+        }
+
+        std::size_t size() const {
+            return m_end - m_begin;
+        }
+
+        bool empty() const {
+            return m_begin == m_end;
+        }
+    };
+
+    /***
+     * Iterates over the groups of the sorted index.
+     */
+    class const_iterator {
+
+        const Entry *m_last;
+        const Entry *m_begin;
+        const Entry *m_end;
+
+        const Entry *group_end(const Entry *begin) const {
+            const Entry *end = begin;
+            while (end != m_last && end->node_id == begin->node_id) {
+                ++end;
+            }
+            return end;
+        }
+
+    public:
+
+        const_iterator(const Entry *begin, const Entry *last) :
+                m_last(last),
+                m_begin(begin),
+                m_end(group_end(begin)) {
+        }
+
+        Group operator*() const {
+            return Group(m_begin, m_end);
+        }
+
+        const_iterator& operator++() {
+            m_begin = m_end;
+            m_end = group_end(m_begin);
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return m_begin == other.m_begin;
+        }
+
+        bool operator!=(const const_iterator &other) const {
+            return m_begin != other.m_begin;
+        }
+    };
+
+private:
+
+    enum {
+        run_buffer_size = 4096,
+        small_sort_size = 64
+    };
+
+    typedef std::unique_ptr<FILE, int (*)(FILE*)> file_type;
+
+    /***
+     * Sorted entries spilled into a temporary file, which is unlinked
+     * right after it was created.
+     */
+    struct Run {
+        file_type file;
+        std::size_t size;
+    };
+
+    /***
+     * Read position in a run or, with file == nullptr, in the entries in
+     * memory.
+     */
+    struct Cursor {
+        FILE *file;
+        std::size_t remaining;
+        std::vector<Entry> buffer;
+        const Entry *position;
+        const Entry *end;
+
+        bool next() {
+            if (++position != end) {
+                return true;
+            }
+            return fill();
+        }
+
+        bool fill() {
+            if (!file || remaining == 0) {
+                return false;
+            }
+            const std::size_t count = std::min<std::size_t>(remaining,
+                                                            buffer.size());
+            if (fread(buffer.data(), sizeof(Entry), count, file) != count) {
+                throw std::runtime_error("EndpointIndex: can not read run");
+            }
+            remaining -= count;
+            position = buffer.data();
+            end = position + count;
+            return true;
+        }
+    };
+
+    std::vector<Entry> m_entries;
+    std::vector<Run> m_runs;
+    std::size_t m_spilled_entries = 0;
+    std::size_t m_memory_limit = 0;
+    std::size_t m_num_nodes = 0;
+    bool m_sorted = true;
+
+    /***
+     * Directory of the runs, $TMPDIR or /tmp. Not tmpfile(), which ignores
+     * TMPDIR in glibc.
+     */
+    static std::string temporary_directory() {
+        const char *directory = getenv("TMPDIR");
+        return directory && *directory ? directory : "/tmp";
+    }
+
+    static file_type create_run_file() {
+        std::string name = temporary_directory() + "/osmi_water_runXXXXXX";
+        const int fd = mkstemp(&name[0]);
+        if (fd < 0) {
+            throw std::runtime_error("EndpointIndex: can not create " + name);
+        }
+        unlink(name.c_str());
+        file_type file(fdopen(fd, "w+b"), fclose);
+        if (!file) {
+            close(fd);
+            throw std::runtime_error("EndpointIndex: can not open " + name);
+        }
+        return file;
+    }
+
+    /***
+     * Node ids as unsigned keys in the same order, negative ids first.
+     */
+    static uint64_t sort_key(osmium::object_id_type node_id) {
+        return static_cast<uint64_t>(node_id) ^ (static_cast<uint64_t>(1) << 63);
+    }
+
+    /***
+     * Order of the entries: by node id, then by value. The values grow with
+     * the order the entries are added in (the way indexes are increasing),
+     * so the ways of a node keep the order they were added in.
+     */
+    static bool entry_less(const Entry &a, const Entry &b) {
+        return a.node_id < b.node_id
+               || (a.node_id == b.node_id && a.value < b.value);
+    }
+
+    /***
+     * In-place MSD radix sort (American flag sort) of the range on the
+     * byte of the sort keys at shift and the bytes below it, skipping the
+     * bytes which are the same for all entries. Every byte permutes the
+     * entries into their buckets by swapping, so no second buffer is
+     * needed. Small buckets and the entries of one node are finished with
+     * std::sort.
+     */
+    static void radix_sort(Entry *begin, Entry *end, int shift,
+                           uint64_t varying) {
+        while (shift >= 0 && ((varying >> shift) & 0xff) == 0) {
+            shift -= 8;
+        }
+        if (shift < 0 || end - begin <= small_sort_size) {
+            std::sort(begin, end, entry_less);
+            return;
+        }
+        auto digit = [shift](const Entry &entry) {
+            return static_cast<unsigned>((sort_key(entry.node_id) >> shift)
+                                         & 0xff);
+        };
+
+        std::size_t bounds[257] = {0};
+        for (const Entry *entry = begin; entry != end; ++entry) {
+            ++bounds[digit(*entry) + 1];
+        }
+        for (int i = 0; i < 256; ++i) {
+            bounds[i + 1] += bounds[i];
+        }
+        std::size_t next[256];
+        std::copy(bounds, bounds + 256, next);
+        for (unsigned bucket = 0; bucket < 256; ++bucket) {
+            while (next[bucket] != bounds[bucket + 1]) {
+                Entry entry = begin[next[bucket]];
+                unsigned entry_digit = digit(entry);
+                while (entry_digit != bucket) {
+                    std::swap(entry, begin[next[entry_digit]++]);
+                    entry_digit = digit(entry);
+                }
+                begin[next[bucket]++] = entry;
+            }
+        }
+
+        for (unsigned bucket = 0; bucket < 256; ++bucket) {
+            if (bounds[bucket + 1] - bounds[bucket] > 1) {
+                radix_sort(begin + bounds[bucket], begin + bounds[bucket + 1],
+                           shift - 8, varying);
+            }
+        }
+    }
+
+    void radix_sort() {
+        if (m_entries.empty()) {
+            return;
+        }
+        uint64_t varying = 0;
+        const uint64_t first_key = sort_key(m_entries.front().node_id);
+        for (const auto& entry : m_entries) {
+            varying |= sort_key(entry.node_id) ^ first_key;
+        }
+        radix_sort(m_entries.data(), m_entries.data() + m_entries.size(), 56,
+                   varying);
+    }
+
+    const Entry *data() const {
+        return m_entries.data();
+    }
+
+    void check_in_memory() const {
+        if (!m_runs.empty()) {
+            throw std::runtime_error(
+                    "EndpointIndex: entries are spilled, use for_each_group()");
+        }
+    }
+
+    /***
+     * The sort needs no scratch space, so the whole limit holds entries.
+     */
+    std::size_t max_entries() const {
+        return std::max<std::size_t>(m_memory_limit / sizeof(Entry), 1);
+    }
+
+    void append(const Entry &entry) {
+        if (m_memory_limit) {
+            if (m_entries.size() >= max_entries()) {
+                spill();
+            } else if (m_entries.capacity() == 0) {
+                m_entries.reserve(max_entries());
+            }
+        }
+        m_entries.push_back(entry);
+        m_sorted = false;
+    }
+
+    /***
+     * Sort the entries in memory and move them into a new run.
+     */
+    void spill() {
+        radix_sort();
+        file_type file = create_run_file();
+        if (fwrite(m_entries.data(), sizeof(Entry), m_entries.size(),
+                   file.get()) != m_entries.size()) {
+            throw std::runtime_error("EndpointIndex: can not write run");
+        }
+        m_runs.push_back(Run{std::move(file), m_entries.size()});
+        m_spilled_entries += m_entries.size();
+        m_entries.clear();
+    }
+
+    /***
+     * k-way merge of the runs and the sorted entries in memory. The runs
+     * are older than the entries in memory, so taking equal node ids in
+     * the order of the runs keeps the ways in the order they were added.
+     * Counts the nodes for size().
+     */
+    template <typename TFunc>
+    void merge(TFunc &&func) {
+        m_num_nodes = 0;
+        std::vector<Cursor> cursors(m_runs.size() + 1);
+        for (std::size_t i = 0; i < m_runs.size(); ++i) {
+            rewind(m_runs[i].file.get());
+            cursors[i].file = m_runs[i].file.get();
+            cursors[i].remaining = m_runs[i].size;
+            cursors[i].buffer.resize(run_buffer_size);
+        }
+        cursors.back().file = nullptr;
+        cursors.back().remaining = 0;
+        cursors.back().position = data();
+        cursors.back().end = data() + m_entries.size();
+
+        typedef std::pair<osmium::object_id_type, std::size_t> head_type;
+        std::priority_queue<head_type, std::vector<head_type>,
+                            std::greater<head_type>> heads;
+        for (std::size_t i = 0; i < cursors.size(); ++i) {
+            if (cursors[i].file ? cursors[i].fill()
+                                : cursors[i].position != cursors[i].end) {
+                heads.push(head_type(cursors[i].position->node_id, i));
+            }
+        }
+
+        std::vector<Entry> group;
+        while (!heads.empty()) {
+            const osmium::object_id_type node_id = heads.top().first;
+            group.clear();
+            while (!heads.empty() && heads.top().first == node_id) {
+                Cursor &cursor = cursors[heads.top().second];
+                const std::size_t run = heads.top().second;
+                heads.pop();
+                bool more;
+                do {
+                    group.push_back(*cursor.position);
+                    more = cursor.next();
+                } while (more && cursor.position->node_id == node_id);
+                if (more) {
+                    heads.push(head_type(cursor.position->node_id, run));
+                }
+            }
+            ++m_num_nodes;
+            func(Group(group.data(), group.data() + group.size()));
+        }
+    }
+
+public:
+
+    /***
+     * Add the way with index way_index for node_id. roles is a combination
+     * of role_first and role_last.
+     */
+    void add(osmium::object_id_type node_id, std::size_t way_index,
+             uint64_t roles) {
+        append(Entry{node_id,
+                     (static_cast<uint64_t>(way_index) << 2) | roles});
+    }
+
+    /***
+     * Add an entry of another index (--resume).
+     */
+    void add_entry(const Entry &entry) {
+        append(entry);
+    }
+
+    /***
+     * Spill the entries into temporary files whenever they take more than
+     * bytes of memory. 0 keeps all entries in memory. Must be called
+     * before the first entry is added.
+     */
+    void set_memory_limit(std::size_t bytes) {
+        m_memory_limit = bytes;
+    }
+
+    /***
+     * Sort the entries added since the last sort. The ways of a node keep
+     * the order they were added in. With spilled runs only the entries in
+     * memory are sorted, the nodes are counted by the next merge.
+     */
+    void sort() {
+        if (m_sorted) {
+            return;
+        }
+        radix_sort();
+        m_sorted = true;
+        if (!m_runs.empty()) {
+            return;
+        }
+        m_num_nodes = 0;
+        for (std::size_t i = 0; i < m_entries.size(); ++i) {
+            if (i == 0 || m_entries[i].node_id != m_entries[i - 1].node_id) {
+                ++m_num_nodes;
+            }
+        }
+    }
+
+    /***
+     * Call func(group) for the groups of all nodes in the order of the
+     * node ids. The group is only valid during the call.
+     */
+    template <typename TFunc>
+    void for_each_group(TFunc &&func) {
+        sort();
+        if (m_runs.empty()) {
+            for (const auto& group : *this) {
+                func(group);
+            }
+        } else {
+            merge(std::forward<TFunc>(func));
+        }
+    }
+
+    bool spilled() const {
+        return !m_runs.empty();
+    }
+
+    /***
+     * The ways of node_id, empty if it is no end node.
+     */
+    Group find(osmium::object_id_type node_id) {
+        check_in_memory();
+        sort();
+        const Entry *end = data() + m_entries.size();
+        const Entry *begin = std::lower_bound(data(), end, node_id,
+                [](const Entry &entry, osmium::object_id_type id) {
+                    return entry.node_id < id;
+                });
+        const Entry *last = begin;
+        while (last != end && last->node_id == node_id) {
+            ++last;
+        }
+        return Group(begin, last);
+    }
+
+    bool contains(osmium::object_id_type node_id) {
+        return !find(node_id).empty();
+    }
+
+    const_iterator begin() {
+        check_in_memory();
+        sort();
+        return const_iterator(data(), data() + m_entries.size());
+    }
+
+    const_iterator end() {
+        check_in_memory();
+        sort();
+        return const_iterator(data() + m_entries.size(),
+                              data() + m_entries.size());
+    }
+
+    /***
+     * Number of end nodes. With spilled runs the number counted by the
+     * last for_each_group(), 0 before.
+     */
+    std::size_t size() {
+        sort();
+        return m_num_nodes;
+    }
+
+    std::size_t num_entries() const {
+        return m_entries.size() + m_spilled_entries;
+    }
+
+    std::size_t spilled_entries() const {
+        return m_spilled_entries;
+    }
+
+    std::size_t used_memory() const {
+        return m_entries.capacity() * sizeof(Entry);
+    }
+
+    void clear() {
+        std::vector<Entry>().swap(m_entries);
+        m_runs.clear();
+        m_spilled_entries = 0;
+        m_num_nodes = 0;
+        m_sorted = true;
+    }
+};
+
+#endif /* ENDPOINTINDEX_HPP_ */
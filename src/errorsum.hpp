@@ -18,6 +18,10 @@ public:
     error_sum(0){
     }
 
+    explicit ErrorSum(short error_sum) :
+    error_sum(error_sum){
+    }
+
     void set_to_normal() {
         error_sum = 0;
     }
@@ -70,60 +74,60 @@ public:
         error_sum += 2048;
     }
 
-    bool is_normal() {
+    bool is_normal() const {
         return (!error_sum);
     }
 
-    bool is_direction_error() {
+    bool is_direction_error() const {
         return (CHECK_BIT(error_sum,0));
     }
 
-    bool is_name_error() {
+    bool is_name_error() const {
         return (CHECK_BIT(error_sum,1));
     }
 
-    bool is_type_error() {
+    bool is_type_error() const {
         return (CHECK_BIT(error_sum,2));
     }
 
-    bool is_spring_error() {
+    bool is_spring_error() const {
         return (CHECK_BIT(error_sum,3));
     }
 
-    bool is_end_error() {
+    bool is_end_error() const {
         return (CHECK_BIT(error_sum,4));
     }
 
-    bool is_rivermouth() {
+    bool is_rivermouth() const {
         return (CHECK_BIT(error_sum,5));
     }
 
-    bool is_outflow() {
+    bool is_outflow() const {
         return (CHECK_BIT(error_sum,6));
     }
 
-    bool is_poss_rivermouth() {
+    bool is_poss_rivermouth() const {
         return (CHECK_BIT(error_sum,7));
     }
 
-    bool is_poss_outflow() {
+    bool is_poss_outflow() const {
         return (CHECK_BIT(error_sum,8));
     }
 
-    bool is_stream() {
+    bool is_stream() const {
         return (CHECK_BIT(error_sum,9));
     }
 
-    bool is_river() {
+    bool is_river() const {
         return (CHECK_BIT(error_sum,10));
     }
 
-    bool is_way_error() {
+    bool is_way_error() const {
         return (CHECK_BIT(error_sum,11));
     }
 
     //DEBUG
-    short errsum() {
+    short errsum() const {
         return error_sum;
     }
     /***
@@ -3,40 +3,59 @@
  * through analyse_nodes().
  *   - iterates in pass 3 over all relevant ways
  *   - iterates in pass 4 over all areas
+ * In two pass mode the way nodes are recorded in pass 2 and checked in
+ * memory afterwards instead of reading the input a third time.
  */
 
 #ifndef FALSEPOSITIVES_HPP_
 #define FALSEPOSITIVES_HPP_
 
+#include <algorithm>
+#include <cstdint>
+#include <future>
 #include <iostream>
-#include <osmium/geom/geos.hpp>
-#include <osmium_geos_factory/geos_factory.hpp>
-#include <geos/geom/MultiPolygon.h>
-#include <geos/geom/Point.h>
+#include <memory>
+#include <utility>
+#include <vector>
 #include <osmium/handler.hpp>
 #include <osmium/osm/location.hpp>
 #include <osmium/handler/node_locations_for_ways.hpp>
-#include <geos/index/strtree/STRtree.h>
-#include <geos/geom/prep/PreparedPolygon.h>
+#include <osmium/thread/pool.hpp>
 
+#include "hilbert.hpp"
+#include "locationindex.hpp"
+#include "nodevisits.hpp"
 
-typedef osmium::handler::NodeLocationsForWays<index_pos_type,
-                                              index_neg_type>
-        location_handler_type;
-typedef geos::geom::prep::PreparedPolygon prepared_polygon_type;
 
 class IndicateFalsePositives: public osmium::handler::Handler {
 
+    enum check_status : char {
+        not_contained = 0,
+        contained = 1,
+        location_missing = 2
+    };
+
+    /***
+     * An error node with its location and the Hilbert index of it.
+     */
+    struct ErrorCandidate {
+        uint64_t hilbert;
+        osmium::object_id_type node_id;
+        osmium::Location location;
+    };
+
     DataStorage &ds;
     location_handler_type &location_handler;
-    osmium_geos_factory::GEOSFactory<> geos_factory;
+    osmium::thread::Pool &pool;
+    bool record_nodes;
+    NodeVisits recorded_nodes;
 
-    bool is_valid(const osmium::OSMObject& osm_object) {
-        return TagCheck::is_way_to_analyse(osm_object);
+    bool is_valid(const TagClass &tags) {
+        return TagCheck::is_way_to_analyse(tags);
     }
 
-    bool check_all_nodes(const osmium::Way& way) {
-        return TagCheck::is_riverbank_or_coastline(way);
+    bool check_all_nodes(const TagClass &tags) {
+        return TagCheck::is_riverbank_or_coastline(tags);
     }
 
     void errormsg(const osmium::Area &area) {
@@ -49,38 +68,109 @@ class IndicateFalsePositives: public osmium::handler::Handler {
     }
 
     /***
-     * Search given node in the error_map. Traced nodes are either flagged as
-     * mouth or deleted from the map and inserted as normal node.
+     * sum is a reference into error_map and invalid after the erase.
      */
-    void check_node(const osmium::NodeRef& node) {
-        osmium::object_id_type node_id = node.ref();
-        auto error_node = ds.error_map.find(node_id);
-        if (error_node != ds.error_map.end()) {
-            ErrorSum *sum = error_node->second;
-            delete_error_node(node_id, sum);
-        }
-    }
-
-    void delete_error_node(osmium::object_id_type node_id, ErrorSum *sum) {
-        if (sum->is_poss_rivermouth()) {
-            sum->set_rivermouth();
-        } else if (sum->is_poss_outflow()) {
-            sum->set_outflow();
+    void delete_error_node(osmium::object_id_type node_id, ErrorSum &sum) {
+        if (sum.is_poss_rivermouth()) {
+            sum.set_rivermouth();
+        } else if (sum.is_poss_outflow()) {
+            sum.set_outflow();
         } else {
-            sum->set_to_normal();
+            sum.set_to_normal();
             ds.insert_node_feature(
                     location_handler.get_node_location(node_id),
                     node_id, sum);
             ds.error_map.erase(node_id);
-            delete sum;
         }
     }
 
+    /***
+     * Runs in a worker thread: test the error nodes [first, last) of the
+     * Hilbert ordered candidates against the polygon tree in one batch.
+     * Only reads the tree and the fixed point polygons.
+     */
+    std::vector<char> find_contained(
+            const std::vector<ErrorCandidate> &candidates,
+            std::size_t first, std::size_t last) const {
+        std::vector<char> status(last - first, not_contained);
+        std::vector<std::pair<double, double>> coordinates(last - first);
+        for (std::size_t i = first; i < last; ++i) {
+            const osmium::Location &location = candidates[i].location;
+            if (!location.valid()) {
+                status[i - first] = location_missing;
+                continue;
+            }
+            coordinates[i - first] = std::make_pair(location.lon(),
+                                                    location.lat());
+        }
+        ds.polygon_tree.query(coordinates,
+                [this, &candidates, &status, first](std::size_t i,
+                                                    uint32_t polygon) {
+                    if (status[i] != not_contained) {
+                        return true;
+                    }
+                    if (ds.fixed_polygon_set[polygon].contains(
+                            candidates[first + i].location)) {
+                        status[i] = contained;
+                        return true;
+                    }
+                    return false;
+                });
+        return status;
+    }
+
+    /***
+     * The error_map is not complete before analyse_nodes() ran, so in two
+     * pass mode only the node id is remembered.
+     */
+    void visit_node(const osmium::NodeRef& node) {
+        if (record_nodes) {
+            recorded_nodes.add(node.ref());
+        } else {
+            check_node(node.ref());
+        }
+    }
+
+    /***
+     * Remember the nodes of the way for a later update (--state).
+     */
+    void record_checked_nodes(const osmium::Way &way,
+                              const osmium::NodeRef *first,
+                              const osmium::NodeRef *last) {
+        ChangeState *state = ds.change_state();
+        if (!state) {
+            return;
+        }
+        std::vector<osmium::object_id_type> node_ids;
+        node_ids.reserve(last - first);
+        for (auto node = first; node != last; ++node) {
+            node_ids.push_back(node->ref());
+        }
+        state->set_checked_nodes(way.id(), std::move(node_ids));
+    }
+
 public:
 
     explicit IndicateFalsePositives(DataStorage &data_storage,
-            location_handler_type &location_handler) :
-            ds(data_storage), location_handler(location_handler) {
+            location_handler_type &location_handler,
+            osmium::thread::Pool &pool,
+            bool record_nodes = false) :
+            ds(data_storage), location_handler(location_handler),
+            pool(pool), record_nodes(record_nodes) {
+    }
+
+    /***
+     * Search given node in the error_map. Traced nodes are either flagged as
+     * mouth or deleted from the map and inserted as normal node.
+     */
+    void check_node(osmium::object_id_type node_id) {
+        if (!ds.may_be_error_node(node_id)) {
+            return;
+        }
+        auto error_node = ds.error_map.find(node_id);
+        if (error_node != ds.error_map.end()) {
+            delete_error_node(node_id, error_node->second);
+        }
     }
 
     /***
@@ -89,57 +179,106 @@ public:
      * firstnode and lastnode.
      */
     void way(const osmium::Way& way) {
-        if (is_valid(way)) {
-            if (check_all_nodes(way)) {
+        const TagClass tags = TagCheck::classify(way);
+        if (is_valid(tags)) {
+            if (check_all_nodes(tags)) {
                 for (auto node : way.nodes()) {
-                    check_node(node);
+                    visit_node(node);
                 }
+                record_checked_nodes(way, way.nodes().begin(),
+                                     way.nodes().end());
             } else {
                 if (way.nodes().size() > 2) {
                     for (auto node = way.nodes().begin() + 1;
                             node != way.nodes().end() - 1; ++node) {
-                        check_node(*node);
+                        visit_node(*node);
                     }
+                    record_checked_nodes(way, way.nodes().begin() + 1,
+                                         way.nodes().end() - 1);
                 }
             }
         }
     }
 
+    /***
+     * Two pass mode: check the way nodes recorded in pass 2 as often as
+     * pass 3 would have visited them.
+     */
+    void check_recorded_nodes() {
+        recorded_nodes.for_each([this](osmium::object_id_type node_id) {
+            check_node(node_id);
+        });
+        recorded_nodes.clear();
+    }
+
+    const NodeVisits& recorded_visits() const {
+        return recorded_nodes;
+    }
+
     /***
      * Check all waterpolygons in pass 4: Iterate over error map and search
      * the node in the polygon tree by bounding box.
-     * If found do geos contains with the polygon to make sure, the node is
+     * If found test the fixed point polygon to make sure, the node is
      * containing in the polygon.
      * If the poylgon contains the error node the error is detected as a false
      * possitive and is either a normal node or a river mouth.
+     *
+     * The error nodes are sorted in Hilbert order of their locations and
+     * cut into chunks for the thread pool, so each task queries nodes close
+     * to each other and touches the same tree nodes and polygons.
      */
     void check_area() {
-        for (auto node : ds.error_map) {
+        if (ds.error_map.empty()) {
+            return;
+        }
+        std::vector<ErrorCandidate> candidates;
+        candidates.reserve(ds.error_map.size());
+        for (const auto& node : ds.error_map) {
             osmium::Location location;
-            osmium::object_id_type node_id = node.first;
-            const geos::geom::Point *point = nullptr;
             try {
-                location = location_handler.get_node_location(node_id);
-                point = geos_factory.create_point(location).release();
+                location = location_handler.get_node_location(node.first);
             } catch (...) {
-                std::cerr << "Error at node: " << node_id
+                std::cerr << "Error at node: " << node.first
                      << " - not able to create point of location.\n";
                 continue;
             }
-            std::vector<void *> results;
-            ds.polygon_tree.query(point->getEnvelopeInternal(), results);
-            if (results.size()) {
-                for (auto result : results) {
-                    prepared_polygon_type *geos_polygon;
-                    geos_polygon = static_cast<prepared_polygon_type*> (result);
-                    if (geos_polygon->contains(point)) {
-                        ErrorSum *sum = node.second;
-                        delete_error_node(node_id, sum);
-                        break;
-                    }
+            candidates.push_back(ErrorCandidate{Hilbert::index(location),
+                                                node.first, location});
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                [](const ErrorCandidate &a, const ErrorCandidate &b) {
+                    return a.hilbert < b.hilbert;
+                });
+        if (candidates.empty()) {
+            return;
+        }
+        ds.polygon_tree.build();
+
+        const std::size_t num_chunks = std::min(candidates.size(),
+                static_cast<std::size_t>(pool.num_threads()) * 4);
+        const std::size_t chunk_size = (candidates.size() + num_chunks - 1)
+                                       / num_chunks;
+        std::vector<std::future<std::vector<char>>> results;
+        for (std::size_t first = 0; first < candidates.size();
+                first += chunk_size) {
+            const std::size_t last = std::min(first + chunk_size,
+                                              candidates.size());
+            results.push_back(pool.submit([this, &candidates, first, last] {
+                return find_contained(candidates, first, last);
+            }));
+        }
+
+        std::size_t idx = 0;
+        for (auto& result : results) {
+            for (char status : result.get()) {
+                osmium::object_id_type node_id = candidates[idx++].node_id;
+                if (status == location_missing) {
+                    std::cerr << "Error at node: " << node_id
+                         << " - not able to create point of location.\n";
+                } else if (status == contained) {
+                    delete_error_node(node_id, ds.error_map[node_id]);
                 }
             }
-            delete point;
         }
     }
 };
@@ -0,0 +1,213 @@
+/***
+ * FixedPolygon is a water polygon (outer ring and holes) in the fixed point
+ * coordinates of osmium::Location, answering point in polygon queries with
+ * exact integer arithmetic. It is built from the rings of the osmium::Area
+ * or from the edges stored in a snapshot.
+ *
+ * The edges of all rings are indexed in horizontal bands, a query only
+ * looks at the edges of the band of the point. Like the GEOS contains()
+ * it replaces, a point on a ring is not contained.
+ */
+
+#ifndef FIXEDPOLYGON_HPP_
+#define FIXEDPOLYGON_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/location.hpp>
+
+
+class FixedPolygon {
+
+public:
+
+    /***
+     * The lower end of the edge comes first: y1 <= y2.
+     */
+    struct Edge {
+        int32_t x1;
+        int32_t y1;
+        int32_t x2;
+        int32_t y2;
+    };
+
+private:
+
+    enum {
+        edges_per_band = 4,
+        max_bands = 4096
+    };
+
+    std::vector<Edge> m_edges;
+
+    /***
+     * The edges of band b are m_band_edges[m_band_offsets[b]] up to
+     * m_band_edges[m_band_offsets[b + 1]].
+     */
+    std::vector<uint32_t> m_band_offsets;
+    std::vector<uint32_t> m_band_edges;
+
+    int32_t m_min_x = 0;
+    int32_t m_min_y = 0;
+    int32_t m_max_x = 0;
+    int32_t m_max_y = 0;
+    int64_t m_band_height = 1;
+
+    void add_ring(const osmium::NodeRefList &ring) {
+        if (ring.size() < 2) {
+            return;
+        }
+        osmium::Location previous = ring.front().location();
+        for (const auto& node_ref : ring) {
+            const osmium::Location location = node_ref.location();
+            if (location != previous) {
+                if (previous.y() <= location.y()) {
+                    m_edges.push_back(Edge{previous.x(), previous.y(),
+                                           location.x(), location.y()});
+                } else {
+                    m_edges.push_back(Edge{location.x(), location.y(),
+                                           previous.x(), previous.y()});
+                }
+            }
+            previous = location;
+        }
+    }
+
+    std::size_t band(int32_t y) const {
+        return static_cast<std::size_t>(
+                (static_cast<int64_t>(y) - m_min_y) / m_band_height);
+    }
+
+    void build_bands() {
+        if (m_edges.empty()) {
+            return;
+        }
+        m_min_x = m_max_x = m_edges.front().x1;
+        m_min_y = m_max_y = m_edges.front().y1;
+        for (const auto& edge : m_edges) {
+            m_min_x = std::min({m_min_x, edge.x1, edge.x2});
+            m_max_x = std::max({m_max_x, edge.x1, edge.x2});
+            m_min_y = std::min(m_min_y, edge.y1);
+            m_max_y = std::max(m_max_y, edge.y2);
+        }
+
+        const std::size_t num_bands = std::min<std::size_t>(
+                m_edges.size() / edges_per_band + 1, max_bands);
+        m_band_height = (static_cast<int64_t>(m_max_y) - m_min_y)
+                        / static_cast<int64_t>(num_bands) + 1;
+
+        m_band_offsets.assign(num_bands + 1, 0);
+        for (const auto& edge : m_edges) {
+            for (std::size_t b = band(edge.y1); b <= band(edge.y2); ++b) {
+                ++m_band_offsets[b + 1];
+            }
+        }
+        for (std::size_t b = 0; b < num_bands; ++b) {
+            m_band_offsets[b + 1] += m_band_offsets[b];
+        }
+        m_band_edges.resize(m_band_offsets.back());
+        std::vector<uint32_t> positions(m_band_offsets.begin(),
+                                        m_band_offsets.end() - 1);
+        for (uint32_t i = 0; i < m_edges.size(); ++i) {
+            for (std::size_t b = band(m_edges[i].y1);
+                    b <= band(m_edges[i].y2); ++b) {
+                m_band_edges[positions[b]++] = i;
+            }
+        }
+    }
+
+    /***
+     * Compares the cross products of (edge, point - edge start) without
+     * overflow: the differences fit in 33 bits, the products in 63 bits.
+     * Greater than 0 if the point is left of the edge.
+     */
+    static int side(const Edge &edge, int32_t x, int32_t y) {
+        const int64_t left = (static_cast<int64_t>(edge.x2) - edge.x1)
+                             * (static_cast<int64_t>(y) - edge.y1);
+        const int64_t right = (static_cast<int64_t>(x) - edge.x1)
+                              * (static_cast<int64_t>(edge.y2) - edge.y1);
+        return (left > right) - (left < right);
+    }
+
+public:
+
+    /***
+     * The polygon of outer_ring and its inner rings in area.
+     */
+    FixedPolygon(const osmium::Area &area, const osmium::OuterRing &outer_ring) {
+        add_ring(outer_ring);
+        for (const auto& inner_ring : area.inner_rings(outer_ring)) {
+            add_ring(inner_ring);
+        }
+        build_bands();
+    }
+
+    FixedPolygon(const Edge *first, const Edge *last) :
+            m_edges(first, last) {
+        build_bands();
+    }
+
+    const std::vector<Edge>& edges() const {
+        return m_edges;
+    }
+
+    /***
+     * The bounding box in fixed point coordinates, only valid if the
+     * polygon has edges.
+     */
+    osmium::Location bottom_left() const {
+        return osmium::Location(m_min_x, m_min_y);
+    }
+
+    osmium::Location top_right() const {
+        return osmium::Location(m_max_x, m_max_y);
+    }
+
+    /***
+     * Whether location is in the interior of the polygon. Counts the
+     * edges crossing the ray from location to the right, an edge counts
+     * if it starts at or below the ray and ends above it.
+     */
+    bool contains(const osmium::Location &location) const {
+        const int32_t x = location.x();
+        const int32_t y = location.y();
+        if (m_edges.empty() || x < m_min_x || x > m_max_x
+                || y < m_min_y || y > m_max_y) {
+            return false;
+        }
+        const std::size_t b = band(y);
+        bool inside = false;
+        for (uint32_t i = m_band_offsets[b]; i < m_band_offsets[b + 1]; ++i) {
+            const Edge &edge = m_edges[m_band_edges[i]];
+            if (y < edge.y1 || y > edge.y2) {
+                continue;
+            }
+            if (edge.y1 == edge.y2) {
+                if (x >= std::min(edge.x1, edge.x2)
+                        && x <= std::max(edge.x1, edge.x2)) {
+                    return false;
+                }
+                continue;
+            }
+            const int s = side(edge, x, y);
+            if (s == 0 && x >= std::min(edge.x1, edge.x2)
+                    && x <= std::max(edge.x1, edge.x2)) {
+                return false;
+            }
+            if (y < edge.y2 && s > 0) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    std::size_t used_memory() const {
+        return m_edges.capacity() * sizeof(Edge)
+               + (m_band_offsets.capacity() + m_band_edges.capacity())
+                 * sizeof(uint32_t);
+    }
+};
+
+#endif /* FIXEDPOLYGON_HPP_ */
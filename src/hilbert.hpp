@@ -0,0 +1,50 @@
+/***
+ * Position of a location on a Hilbert curve through the whole world.
+ * Sorting by it keeps neighbouring locations close to each other.
+ */
+
+#ifndef HILBERT_HPP_
+#define HILBERT_HPP_
+
+#include <cstdint>
+#include <utility>
+#include <osmium/osm/location.hpp>
+
+
+class Hilbert {
+
+    /***
+     * Offset moving the coordinates of osmium::Location into the positive
+     * range of uint32_t.
+     */
+    static constexpr int64_t coordinate_offset = 1800000000;
+
+public:
+
+    /***
+     * Index of (x, y) on the Hilbert curve of order 32.
+     */
+    static uint64_t index(uint32_t x, uint32_t y) {
+        uint64_t d = 0;
+        for (uint32_t s = 1u << 31; s > 0; s >>= 1) {
+            const uint32_t rx = (x & s) ? 1 : 0;
+            const uint32_t ry = (y & s) ? 1 : 0;
+            d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = ~x;
+                    y = ~y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    static uint64_t index(const osmium::Location &location) {
+        return index(static_cast<uint32_t>(location.x() + coordinate_offset),
+                     static_cast<uint32_t>(location.y() + coordinate_offset));
+    }
+};
+
+#endif /* HILBERT_HPP_ */
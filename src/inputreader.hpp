@@ -0,0 +1,66 @@
+/***
+ * InputReader opens the osmium::io::Reader of every pass with the same
+ * settings: the PBF blocks are decoded in the thread pool of the run
+ * (--threads) and the read-ahead queues hold --read-queue buffers. It
+ * counts the bytes read for the throughput in the stats.
+ */
+
+#ifndef INPUTREADER_HPP_
+#define INPUTREADER_HPP_
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/thread/pool.hpp>
+
+
+class InputReader {
+
+    osmium::thread::Pool &m_pool;
+    std::size_t m_bytes_read = 0;
+
+public:
+
+    explicit InputReader(osmium::thread::Pool &pool) :
+            m_pool(pool) {
+    }
+
+    /***
+     * Set the size of the read-ahead queues of all readers opened later.
+     * libosmium reads it from the environment. 0 keeps the defaults.
+     */
+    static void set_queue_size(std::size_t queue_size) {
+        if (queue_size == 0) {
+            return;
+        }
+        const std::string value = std::to_string(queue_size);
+        setenv("OSMIUM_MAX_INPUT_QUEUE_SIZE", value.c_str(), 1);
+        setenv("OSMIUM_MAX_OSMDATA_QUEUE_SIZE", value.c_str(), 1);
+    }
+
+    std::unique_ptr<osmium::io::Reader> open(const std::string &filename,
+            osmium::osm_entity_bits::type entities =
+                    osmium::osm_entity_bits::all) {
+        return std::unique_ptr<osmium::io::Reader>(
+                new osmium::io::Reader(filename, entities, m_pool));
+    }
+
+    void close(osmium::io::Reader &reader) {
+        m_bytes_read += reader.offset();
+        reader.close();
+    }
+
+    /***
+     * Bytes read since the last call.
+     */
+    std::size_t take_bytes_read() {
+        std::size_t bytes_read = m_bytes_read;
+        m_bytes_read = 0;
+        return bytes_read;
+    }
+};
+
+#endif /* INPUTREADER_HPP_ */
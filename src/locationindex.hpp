@@ -0,0 +1,104 @@
+/***
+ * Node location index shared by all handlers. The storage backend for the
+ * positive node ids is chosen at runtime (--index-type), negative ids are
+ * not stored at all.
+ *
+ * Useful types are:
+ *  sparse_mem_array          = sorted in-RAM array, small extracts (default)
+ *  flex_mem                  = switches from sparse to dense on big input
+ *  dense_mmap_array          = anonymous mmap, continent or planet input
+ *  dense_file_array,FILENAME = file backed mmap, the file is kept and can be
+ *                              reused by a later run
+ *
+ * With --water-locations only the locations of the nodes in a
+ * node_id_set_type collected in pass 1 are stored.
+ */
+
+#ifndef LOCATIONINDEX_HPP_
+#define LOCATIONINDEX_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <osmium/handler.hpp>
+#include <osmium/index/id_set.hpp>
+#include <osmium/index/map/all.hpp>
+#include <osmium/index/map/dummy.hpp>
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type,
+                                  osmium::Location>
+        index_neg_type;
+
+typedef osmium::index::map::Map<osmium::unsigned_object_id_type,
+                                osmium::Location>
+        index_pos_type;
+
+typedef osmium::handler::NodeLocationsForWays<index_pos_type,
+                                              index_neg_type>
+        location_handler_type;
+
+typedef osmium::index::IdSetDense<osmium::unsigned_object_id_type>
+        node_id_set_type;
+
+/***
+ * Passes the nodes in the id set (all nodes without one) on to the
+ * location handler, use it in the handler chain instead of the location
+ * handler. The id set uses the positive ids.
+ */
+class FilteredLocationHandler : public osmium::handler::Handler {
+
+    location_handler_type &m_location_handler;
+    const node_id_set_type *m_node_ids;
+
+public:
+
+    FilteredLocationHandler(location_handler_type &location_handler,
+                            const node_id_set_type *node_ids) :
+            m_location_handler(location_handler),
+            m_node_ids(node_ids) {
+    }
+
+    void node(const osmium::Node &node) {
+        if (!m_node_ids || m_node_ids->get(node.positive_id())) {
+            m_location_handler.node(node);
+        }
+    }
+
+    void way(osmium::Way &way) {
+        m_location_handler.way(way);
+    }
+};
+
+class LocationIndex {
+
+    typedef osmium::index::MapFactory<osmium::unsigned_object_id_type,
+                                      osmium::Location>
+        map_factory_type;
+
+public:
+
+    static const char* default_type() {
+        return "sparse_mem_array";
+    }
+
+    static std::vector<std::string> available_types() {
+        return map_factory_type::instance().map_types();
+    }
+
+    /***
+     * Create the index for the given type string, e.g.
+     * "dense_file_array,nodes.idx". Throws osmium::map_factory_error if the
+     * type is unknown or not available on this system.
+     */
+    static std::unique_ptr<index_pos_type> create(const std::string& type) {
+        return map_factory_type::instance().create_map(type);
+    }
+};
+
+#endif /* LOCATIONINDEX_HPP_ */
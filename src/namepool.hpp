@@ -0,0 +1,134 @@
+/***
+ * NamePool stores every distinct waterway name once and hands out 32 bit
+ * ids for them, so equal names have equal ids.
+ *
+ * The names are kept zero terminated one after the other in one arena,
+ * an open addressing hash table of ids finds known names. Id 0 is the
+ * empty name.
+ */
+
+#ifndef NAMEPOOL_HPP_
+#define NAMEPOOL_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+class NamePool {
+
+    std::vector<char> m_data;
+    std::vector<std::size_t> m_offsets;
+
+    /***
+     * Slots hold id + 1, 0 marks an empty slot. The size is a power of 2
+     * and at most half of the slots are used.
+     */
+    std::vector<uint32_t> m_table;
+
+    static uint32_t hash(const char *str, std::size_t size) {
+        uint32_t value = 2166136261u;
+        for (std::size_t i = 0; i < size; ++i) {
+            value ^= static_cast<unsigned char>(str[i]);
+            value *= 16777619u;
+        }
+        return value;
+    }
+
+    bool equals(uint32_t id, const char *str, std::size_t size) const {
+        const char *name = get(id);
+        return !strncmp(name, str, size) && name[size] == '\0';
+    }
+
+    /***
+     * Slot of str, or the empty slot where it belongs.
+     */
+    std::size_t find_slot(const char *str, std::size_t size) const {
+        const std::size_t mask = m_table.size() - 1;
+        std::size_t slot = hash(str, size) & mask;
+        while (m_table[slot] && !equals(m_table[slot] - 1, str, size)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void grow() {
+        std::vector<uint32_t> table(m_table.size() * 2, 0);
+        m_table.swap(table);
+        for (uint32_t id = 0; id < m_offsets.size(); ++id) {
+            const char *name = get(id);
+            m_table[find_slot(name, strlen(name))] = id + 1;
+        }
+    }
+
+public:
+
+    NamePool() :
+            m_table(1024, 0) {
+        intern("", 0);
+    }
+
+    uint32_t intern(const char *str, std::size_t size) {
+        std::size_t slot = find_slot(str, size);
+        if (m_table[slot]) {
+            return m_table[slot] - 1;
+        }
+        const uint32_t id = static_cast<uint32_t>(m_offsets.size());
+        m_offsets.push_back(m_data.size());
+        m_data.insert(m_data.end(), str, str + size);
+        m_data.push_back('\0');
+        m_table[slot] = id + 1;
+        if (m_offsets.size() * 2 > m_table.size()) {
+            grow();
+        }
+        return id;
+    }
+
+    uint32_t intern(const std::string &str) {
+        return intern(str.data(), str.size());
+    }
+
+    /***
+     * The name of id. Only valid until the next intern().
+     */
+    const char *get(uint32_t id) const {
+        return &m_data[m_offsets[id]];
+    }
+
+    std::size_t size() const {
+        return m_offsets.size();
+    }
+
+    /***
+     * The arena, all names zero terminated in the order of their ids.
+     */
+    const std::vector<char>& data() const {
+        return m_data;
+    }
+
+    /***
+     * Replace the names with those of an arena returned by data().
+     */
+    void assign(const char *data, std::size_t size) {
+        m_data.clear();
+        m_offsets.clear();
+        std::vector<uint32_t>(1024, 0).swap(m_table);
+        const char *end = data + size;
+        while (data < end) {
+            const std::size_t length = strnlen(data, end - data);
+            intern(data, length);
+            data += length + 1;
+        }
+        if (m_offsets.empty()) {
+            intern("", 0);
+        }
+    }
+
+    std::size_t used_memory() const {
+        return m_data.capacity() + m_offsets.capacity() * sizeof(std::size_t)
+               + m_table.capacity() * sizeof(uint32_t);
+    }
+};
+
+#endif /* NAMEPOOL_HPP_ */
@@ -0,0 +1,90 @@
+/***
+ * NodeFilter is a blocked Bloom filter over node ids: every id sets three
+ * bits in one 64 bit word. may_contain() has no false negatives, so a
+ * lookup in the hash map behind it is only needed if it returns true.
+ *
+ * Ids can not be removed. The filter keeps about 16 bits per id, the owner
+ * calls resize() and adds all ids again when full() returns true.
+ */
+
+#ifndef NODEFILTER_HPP_
+#define NODEFILTER_HPP_
+
+#include <cstdint>
+#include <vector>
+#include <osmium/osm/types.hpp>
+
+
+class NodeFilter {
+
+    enum {
+        ids_per_word = 4,
+        min_words = 1024
+    };
+
+    std::vector<uint64_t> m_words;
+    std::size_t m_size = 0;
+
+    static uint64_t hash(osmium::object_id_type node_id) {
+        uint64_t value = static_cast<uint64_t>(node_id);
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdULL;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ULL;
+        value ^= value >> 33;
+        return value;
+    }
+
+    /***
+     * The word is chosen by the low bits of the hash, the three bits in it
+     * by the highest 18 bits.
+     */
+    static uint64_t bits(uint64_t value) {
+        return (1ULL << (value >> 58)) | (1ULL << ((value >> 52) & 63))
+               | (1ULL << ((value >> 46) & 63));
+    }
+
+    std::size_t word(uint64_t value) const {
+        return static_cast<std::size_t>(value & (m_words.size() - 1));
+    }
+
+public:
+
+    NodeFilter() :
+            m_words(min_words, 0) {
+    }
+
+    /***
+     * Clear the filter and size it for num_ids ids.
+     */
+    void resize(std::size_t num_ids) {
+        std::size_t num_words = min_words;
+        while (num_words * ids_per_word < num_ids) {
+            num_words *= 2;
+        }
+        std::vector<uint64_t>(num_words, 0).swap(m_words);
+        m_size = 0;
+    }
+
+    void add(osmium::object_id_type node_id) {
+        const uint64_t value = hash(node_id);
+        m_words[word(value)] |= bits(value);
+        ++m_size;
+    }
+
+    bool may_contain(osmium::object_id_type node_id) const {
+        const uint64_t value = hash(node_id);
+        const uint64_t mask = bits(value);
+        return (m_words[word(value)] & mask) == mask;
+    }
+
+    bool full() const {
+        return m_size >= m_words.size() * ids_per_word;
+    }
+
+    std::size_t used_memory() const {
+        return m_words.capacity() * sizeof(uint64_t);
+    }
+};
+
+#endif /* NODEFILTER_HPP_ */
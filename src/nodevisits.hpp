@@ -0,0 +1,118 @@
+/***
+ * NodeVisits records the way node visits of pass 3 in two pass mode. Only
+ * the number of visits of a node matters, not their order, so the ids are
+ * collected in chunks, each chunk is sorted and stored as the differences
+ * between neighbouring ids in a variable length encoding. A repeated visit
+ * costs one byte, a new id mostly two or three instead of eight.
+ */
+
+#ifndef NODEVISITS_HPP_
+#define NODEVISITS_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <osmium/osm/types.hpp>
+
+
+class NodeVisits {
+
+    enum {
+        chunk_size = 1024 * 1024
+    };
+
+    /***
+     * The encoded differences of a chunk start at offset in m_data, the
+     * first one relative to first_id.
+     */
+    struct Chunk {
+        std::size_t offset;
+        std::size_t count;
+        osmium::object_id_type first_id;
+    };
+
+    std::vector<osmium::object_id_type> m_buffer;
+    std::vector<unsigned char> m_data;
+    std::vector<Chunk> m_chunks;
+    std::size_t m_size = 0;
+
+    void encode_buffer() {
+        if (m_buffer.empty()) {
+            return;
+        }
+        std::sort(m_buffer.begin(), m_buffer.end());
+        m_chunks.push_back(Chunk{m_data.size(), m_buffer.size(),
+                                 m_buffer.front()});
+        osmium::object_id_type previous = m_buffer.front();
+        for (auto node_id : m_buffer) {
+            uint64_t delta = static_cast<uint64_t>(node_id)
+                             - static_cast<uint64_t>(previous);
+            while (delta >= 0x80) {
+                m_data.push_back(static_cast<unsigned char>(delta | 0x80));
+                delta >>= 7;
+            }
+            m_data.push_back(static_cast<unsigned char>(delta));
+            previous = node_id;
+        }
+        m_buffer.clear();
+    }
+
+public:
+
+    void add(osmium::object_id_type node_id) {
+        if (m_buffer.empty()) {
+            m_buffer.reserve(chunk_size);
+        }
+        m_buffer.push_back(node_id);
+        ++m_size;
+        if (m_buffer.size() == chunk_size) {
+            encode_buffer();
+        }
+    }
+
+    /***
+     * Call func(node_id) once per visit, the visits of a node are not
+     * necessarily in a row.
+     */
+    template <typename TFunc>
+    void for_each(TFunc &&func) {
+        encode_buffer();
+        std::vector<osmium::object_id_type>().swap(m_buffer);
+        for (const auto& chunk : m_chunks) {
+            const unsigned char *data = m_data.data() + chunk.offset;
+            uint64_t node_id = static_cast<uint64_t>(chunk.first_id);
+            for (std::size_t i = 0; i < chunk.count; ++i) {
+                uint64_t delta = 0;
+                int shift = 0;
+                while (*data & 0x80) {
+                    delta |= static_cast<uint64_t>(*data++ & 0x7f) << shift;
+                    shift += 7;
+                }
+                delta |= static_cast<uint64_t>(*data++) << shift;
+                node_id += delta;
+                func(static_cast<osmium::object_id_type>(node_id));
+            }
+        }
+    }
+
+    void clear() {
+        std::vector<osmium::object_id_type>().swap(m_buffer);
+        std::vector<unsigned char>().swap(m_data);
+        std::vector<Chunk>().swap(m_chunks);
+        m_size = 0;
+    }
+
+    /***
+     * Number of visits.
+     */
+    std::size_t size() const {
+        return m_size;
+    }
+
+    std::size_t used_memory() const {
+        return m_buffer.capacity() * sizeof(osmium::object_id_type)
+               + m_data.capacity() + m_chunks.capacity() * sizeof(Chunk);
+    }
+};
+
+#endif /* NODEVISITS_HPP_ */
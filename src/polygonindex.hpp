@@ -0,0 +1,261 @@
+/***
+ * PolygonIndex is a static, packed R-tree over the bounding boxes of the
+ * water polygons. It stores 32 bit item numbers (the index into
+ * DataStorage::fixed_polygon_set) instead of pointers.
+ *
+ * All boxes are added first, build() sorts them in Hilbert order of their
+ * centres and packs node_size boxes into each parent node. The boxes of
+ * all levels are kept in one flat float array, leaves first and the root
+ * last. Float boxes are rounded outwards, so no query misses a polygon.
+ * Single point queries do not allocate, all queries are safe to run in
+ * parallel after build().
+ */
+
+#ifndef POLYGONINDEX_HPP_
+#define POLYGONINDEX_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <osmium/osm/location.hpp>
+
+#include "hilbert.hpp"
+
+
+class PolygonIndex {
+
+    enum {
+        node_size = 16,
+        max_stack_size = 512
+    };
+
+    struct Box {
+        float min_x;
+        float min_y;
+        float max_x;
+        float max_y;
+
+        bool contains(double x, double y) const {
+            return min_x <= x && x <= max_x && min_y <= y && y <= max_y;
+        }
+
+        void extend(const Box &other) {
+            min_x = std::min(min_x, other.min_x);
+            min_y = std::min(min_y, other.min_y);
+            max_x = std::max(max_x, other.max_x);
+            max_y = std::max(max_y, other.max_y);
+        }
+    };
+
+    std::vector<Box> m_pending_boxes;
+    std::vector<uint32_t> m_pending_items;
+
+    /***
+     * m_items holds the item of each leaf and the position of the first
+     * child of each inner node. m_level_ends holds the end of each level
+     * in m_boxes, leaves first.
+     */
+    std::vector<Box> m_boxes;
+    std::vector<uint32_t> m_items;
+    std::vector<std::size_t> m_level_ends;
+
+    static float round_down(double value) {
+        float rounded = static_cast<float>(value);
+        if (rounded > value) {
+            rounded = std::nextafter(rounded, -HUGE_VALF);
+        }
+        return rounded;
+    }
+
+    static float round_up(double value) {
+        float rounded = static_cast<float>(value);
+        if (rounded < value) {
+            rounded = std::nextafter(rounded, HUGE_VALF);
+        }
+        return rounded;
+    }
+
+    static uint64_t hilbert_index(const Box &box) {
+        return Hilbert::index(osmium::Location(
+                (static_cast<double>(box.min_x) + box.max_x) / 2,
+                (static_cast<double>(box.min_y) + box.max_y) / 2));
+    }
+
+    std::size_t level_begin(std::size_t level) const {
+        return level ? m_level_ends[level - 1] : 0;
+    }
+
+public:
+
+    /***
+     * Add the bounding box of item. Must be called before build().
+     */
+    void add(double min_x, double min_y, double max_x, double max_y,
+             uint32_t item) {
+        m_pending_boxes.push_back(Box{round_down(min_x), round_down(min_y),
+                                      round_up(max_x), round_up(max_y)});
+        m_pending_items.push_back(item);
+    }
+
+    /***
+     * Pack the added boxes into the tree. Does nothing if the tree is
+     * already built.
+     */
+    void build() {
+        if (!m_boxes.empty() || m_pending_boxes.empty()) {
+            return;
+        }
+        std::vector<std::pair<uint64_t, uint32_t>> order;
+        order.reserve(m_pending_boxes.size());
+        for (uint32_t i = 0; i < m_pending_boxes.size(); ++i) {
+            order.emplace_back(hilbert_index(m_pending_boxes[i]), i);
+        }
+        std::sort(order.begin(), order.end());
+
+        for (const auto& entry : order) {
+            m_boxes.push_back(m_pending_boxes[entry.second]);
+            m_items.push_back(m_pending_items[entry.second]);
+        }
+        std::vector<Box>().swap(m_pending_boxes);
+        std::vector<uint32_t>().swap(m_pending_items);
+
+        std::size_t begin = 0;
+        std::size_t end = m_boxes.size();
+        m_level_ends.push_back(end);
+        while (end - begin > 1) {
+            for (std::size_t first = begin; first < end; first += node_size) {
+                const std::size_t last = std::min<std::size_t>(
+                        first + node_size, end);
+                Box box = m_boxes[first];
+                for (std::size_t i = first + 1; i < last; ++i) {
+                    box.extend(m_boxes[i]);
+                }
+                m_boxes.push_back(box);
+                m_items.push_back(static_cast<uint32_t>(first));
+            }
+            begin = end;
+            end = m_boxes.size();
+            m_level_ends.push_back(end);
+        }
+    }
+
+    /***
+     * Call func(item) for the items whose box contains (x, y) until func
+     * returns true. Returns whether func returned true.
+     */
+    template <typename TFunc>
+    bool query(double x, double y, TFunc &&func) const {
+        if (m_boxes.empty() || !m_boxes.back().contains(x, y)) {
+            return false;
+        }
+        std::pair<std::size_t, std::size_t> stack[max_stack_size];
+        std::size_t stack_size = 0;
+        stack[stack_size++] = std::make_pair(m_boxes.size() - 1,
+                                             m_level_ends.size() - 1);
+        while (stack_size) {
+            const std::size_t position = stack[--stack_size].first;
+            const std::size_t level = stack[stack_size].second;
+            if (level == 0) {
+                if (func(m_items[position])) {
+                    return true;
+                }
+                continue;
+            }
+            const std::size_t first = m_items[position];
+            const std::size_t last = std::min<std::size_t>(first + node_size,
+                    m_level_ends[level - 1]);
+            for (std::size_t child = last; child-- > first; ) {
+                if (m_boxes[child].contains(x, y)) {
+                    stack[stack_size++] = std::make_pair(child, level - 1);
+                }
+            }
+        }
+        return false;
+    }
+
+    /***
+     * Query many points at once: func(i, item) is called for point i
+     * like query() does. The tree is descended once for all points, each
+     * node gets the subset of the points its box contains, so points close
+     * to each other (e.g. in Hilbert order) share the visits of the inner
+     * nodes. Allocates the index lists of the subsets.
+     */
+    template <typename TFunc>
+    void query(const std::vector<std::pair<double, double>> &points,
+               TFunc &&func) const {
+        if (m_boxes.empty() || points.empty()) {
+            return;
+        }
+        struct Frame {
+            std::size_t position;
+            std::size_t level;
+            std::size_t begin;
+            std::size_t end;
+        };
+
+        // the subsets of all frames on the stack, in the order they were
+        // pushed, so the subsets above a popped frame are no longer used
+        std::vector<uint32_t> subsets;
+        std::vector<char> done(points.size(), 0);
+        const Box &root = m_boxes.back();
+        for (uint32_t i = 0; i < points.size(); ++i) {
+            if (root.contains(points[i].first, points[i].second)) {
+                subsets.push_back(i);
+            }
+        }
+        if (subsets.empty()) {
+            return;
+        }
+        std::vector<Frame> stack;
+        stack.push_back(Frame{m_boxes.size() - 1, m_level_ends.size() - 1,
+                              0, subsets.size()});
+        while (!stack.empty()) {
+            const Frame frame = stack.back();
+            stack.pop_back();
+            subsets.resize(frame.end);
+            if (frame.level == 0) {
+                for (std::size_t j = frame.begin; j < frame.end; ++j) {
+                    const uint32_t i = subsets[j];
+                    if (!done[i] && func(i, m_items[frame.position])) {
+                        done[i] = 1;
+                    }
+                }
+                continue;
+            }
+            const std::size_t first = m_items[frame.position];
+            const std::size_t last = std::min<std::size_t>(first + node_size,
+                    m_level_ends[frame.level - 1]);
+            for (std::size_t child = last; child-- > first; ) {
+                const Box &box = m_boxes[child];
+                const std::size_t begin = subsets.size();
+                for (std::size_t j = frame.begin; j < frame.end; ++j) {
+                    const uint32_t i = subsets[j];
+                    if (!done[i] && box.contains(points[i].first,
+                                                 points[i].second)) {
+                        subsets.push_back(i);
+                    }
+                }
+                if (subsets.size() > begin) {
+                    stack.push_back(Frame{child, frame.level - 1, begin,
+                                          subsets.size()});
+                }
+            }
+        }
+    }
+
+    std::size_t size() const {
+        return m_level_ends.empty() ? m_pending_boxes.size()
+                                    : m_level_ends.front();
+    }
+
+    std::size_t used_memory() const {
+        return m_boxes.capacity() * sizeof(Box)
+               + m_items.capacity() * sizeof(uint32_t)
+               + m_pending_boxes.capacity() * sizeof(Box)
+               + m_pending_items.capacity() * sizeof(uint32_t);
+    }
+};
+
+#endif /* POLYGONINDEX_HPP_ */
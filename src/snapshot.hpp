@@ -0,0 +1,391 @@
+/***
+ * Snapshot of the analysis state in DataStorage (--snapshot, --resume).
+ *
+ * Written after pass 2, before analyse_nodes() (stage 2), and after the
+ * false positive checks of pass 3 (stage 3). The file consists of a header
+ * and flat arrays addressed by file offsets, so it is mapped into memory
+ * as it is:
+ *  - the waterways as they are in DataStorage and the arena of their names
+ *  - end nodes sorted by id with location and a range of way indexes
+ *    with the roles of the node (EndpointIndex::Entry::value)
+ *  - the error map
+ *  - the edges of the fixed point water polygons to analyse (stage 2)
+ */
+
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "errorsum.hpp"
+#include "datastorage.hpp"
+#include "fixedpolygon.hpp"
+#include "locationindex.hpp"
+
+
+class Snapshot {
+
+public:
+
+    enum stage_type : uint32_t {
+        after_pass2 = 2,
+        after_pass3 = 3
+    };
+
+    struct EndpointRecord {
+        int64_t node_id;
+        int32_t x;
+        int32_t y;
+        uint64_t first_way;
+        uint64_t num_ways;
+    };
+
+    struct ErrorRecord {
+        int64_t node_id;
+        int16_t error_sum;
+        char padding[6];
+    };
+
+    struct PolygonRecord {
+        uint64_t first_edge;
+        uint64_t num_edges;
+    };
+
+private:
+
+    enum section_type {
+        waterways_section = 0,
+        names_section,
+        endpoints_section,
+        way_indexes_section,
+        errors_section,
+        polygons_section,
+        edges_section,
+        num_sections
+    };
+
+    struct Section {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct Header {
+        char magic[16];
+        uint32_t stage;
+        uint32_t padding;
+        Section sections[num_sections];
+    };
+
+    static const char *magic() {
+        return "osmi_water snap4";
+    }
+
+    const char *m_data = nullptr;
+    std::size_t m_size = 0;
+    const Header *m_header = nullptr;
+
+    /***
+     * Append a section 8 byte aligned and remember its position.
+     */
+    template <typename T>
+    static void write_section(std::ofstream &out, Header &header,
+                              section_type section,
+                              const std::vector<T> &items) {
+        static const char zeros[8] = {0};
+        const uint64_t position = static_cast<uint64_t>(out.tellp());
+        const uint64_t aligned = (position + 7) & ~static_cast<uint64_t>(7);
+        out.write(zeros, aligned - position);
+        header.sections[section].offset = aligned;
+        header.sections[section].size = items.size();
+        out.write(reinterpret_cast<const char*>(items.data()),
+                  items.size() * sizeof(T));
+    }
+
+    template <typename T>
+    const T *section_data(section_type section) const {
+        return reinterpret_cast<const T*>(m_data
+                + m_header->sections[section].offset);
+    }
+
+    std::size_t section_size(section_type section) const {
+        return m_header->sections[section].size;
+    }
+
+    /***
+     * Whether the section is aligned and its items of item_size bytes lie
+     * between the header and the end of the file.
+     */
+    bool valid_section(section_type section, std::size_t item_size) const {
+        const Section &position = m_header->sections[section];
+        return position.offset % 8 == 0
+               && position.offset >= sizeof(Header)
+               && position.offset <= m_size
+               && position.size <= (m_size - position.offset) / item_size;
+    }
+
+    /***
+     * Check the header and that all indexes stored in the sections point
+     * into the sections they refer to, so a truncated or corrupt file is
+     * never read beyond the mapping.
+     */
+    bool valid() const {
+        if (memcmp(m_header->magic, magic(), sizeof(m_header->magic))
+                || (m_header->stage != after_pass2
+                    && m_header->stage != after_pass3)
+                || !valid_section(waterways_section,
+                                  sizeof(DataStorage::WaterWay))
+                || !valid_section(names_section, sizeof(char))
+                || !valid_section(endpoints_section, sizeof(EndpointRecord))
+                || !valid_section(way_indexes_section, sizeof(uint64_t))
+                || !valid_section(errors_section, sizeof(ErrorRecord))
+                || !valid_section(polygons_section, sizeof(PolygonRecord))
+                || !valid_section(edges_section,
+                                  sizeof(FixedPolygon::Edge))) {
+            return false;
+        }
+
+        const char *names = section_data<char>(names_section);
+        const std::size_t names_size = section_size(names_section);
+        if (names_size && names[names_size - 1] != '\0') {
+            return false;
+        }
+        const std::size_t num_names = std::max<std::size_t>(
+                std::count(names, names + names_size, '\0'), 1);
+        const DataStorage::WaterWay *waterways =
+                section_data<DataStorage::WaterWay>(waterways_section);
+        const std::size_t num_waterways = section_size(waterways_section);
+        for (std::size_t i = 0; i < num_waterways; ++i) {
+            if (waterways[i].name_id >= num_names) {
+                return false;
+            }
+        }
+
+        const EndpointRecord *endpoints =
+                section_data<EndpointRecord>(endpoints_section);
+        const uint64_t *way_indexes = section_data<uint64_t>(way_indexes_section);
+        const std::size_t num_way_indexes = section_size(way_indexes_section);
+        for (std::size_t i = 0; i < num_endpoints(); ++i) {
+            if (endpoints[i].first_way > num_way_indexes
+                    || endpoints[i].num_ways
+                       > num_way_indexes - endpoints[i].first_way) {
+                return false;
+            }
+        }
+        for (std::size_t i = 0; i < num_way_indexes; ++i) {
+            if (EndpointIndex::Entry{0, way_indexes[i]}.way_index()
+                    >= num_waterways) {
+                return false;
+            }
+        }
+
+        const PolygonRecord *polygons =
+                section_data<PolygonRecord>(polygons_section);
+        const std::size_t num_edges = section_size(edges_section);
+        for (std::size_t i = 0; i < section_size(polygons_section); ++i) {
+            if (polygons[i].first_edge > num_edges
+                    || polygons[i].num_edges
+                       > num_edges - polygons[i].first_edge) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+
+    /***
+     * Write the state of ds to filename. The end node locations are taken
+     * from the location handler, the polygons only at stage 2.
+     */
+    static void write(const std::string &filename, stage_type stage,
+                      DataStorage &ds,
+                      location_handler_type &location_handler) {
+        std::vector<EndpointRecord> endpoints;
+        std::vector<uint64_t> way_indexes;
+        endpoints.reserve(ds.node_map.size());
+        way_indexes.reserve(ds.node_map.num_entries());
+        ds.node_map.for_each_group([&](const EndpointIndex::Group &node) {
+            osmium::Location location;
+            try {
+                location = location_handler.get_node_location(node.node_id());
+            } catch (...) {
+            }
+            endpoints.push_back(EndpointRecord{node.node_id(), location.x(),
+                                               location.y(),
+                                               way_indexes.size(),
+                                               node.size()});
+            for (const auto& entry : node) {
+                way_indexes.push_back(entry.value);
+            }
+        });
+
+        std::vector<ErrorRecord> errors;
+        for (const auto& error_node : ds.error_map) {
+            ErrorRecord record;
+            memset(&record, 0, sizeof(record));
+            record.node_id = error_node.first;
+            record.error_sum = error_node.second.errsum();
+            errors.push_back(record);
+        }
+        std::sort(errors.begin(), errors.end(),
+                  [](const ErrorRecord &a, const ErrorRecord &b) {
+                      return a.node_id < b.node_id;
+                  });
+
+        std::vector<PolygonRecord> polygons;
+        std::vector<FixedPolygon::Edge> edges;
+        if (stage == after_pass2) {
+            for (const auto& polygon : ds.fixed_polygon_set) {
+                polygons.push_back(PolygonRecord{edges.size(),
+                                                 polygon.edges().size()});
+                edges.insert(edges.end(), polygon.edges().begin(),
+                             polygon.edges().end());
+            }
+        }
+
+        const std::string tmp_filename = filename + ".tmp";
+        {
+            std::ofstream out(tmp_filename, std::ios::binary);
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, magic(), sizeof(header.magic));
+            header.stage = stage;
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            write_section(out, header, waterways_section, ds.waterways());
+            write_section(out, header, names_section, ds.names().data());
+            write_section(out, header, endpoints_section, endpoints);
+            write_section(out, header, way_indexes_section, way_indexes);
+            write_section(out, header, errors_section, errors);
+            write_section(out, header, polygons_section, polygons);
+            write_section(out, header, edges_section, edges);
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (!out) {
+                throw std::runtime_error("Failed to write snapshot "
+                                         + tmp_filename);
+            }
+        }
+        if (std::rename(tmp_filename.c_str(), filename.c_str())) {
+            throw std::runtime_error("Failed to rename snapshot "
+                                     + tmp_filename);
+        }
+    }
+
+    /***
+     * Map the snapshot read only into memory.
+     */
+    explicit Snapshot(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open snapshot " + filename);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) || static_cast<std::size_t>(file_stat.st_size) < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("Not a snapshot: " + filename);
+        }
+        m_size = file_stat.st_size;
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Failed to map snapshot " + filename);
+        }
+        m_data = static_cast<const char*>(data);
+        m_header = reinterpret_cast<const Header*>(m_data);
+        if (memcmp(m_header->magic, magic(), sizeof(m_header->magic))) {
+            munmap(const_cast<char*>(m_data), m_size);
+            throw std::runtime_error("Not a snapshot: " + filename);
+        }
+        if (!valid()) {
+            munmap(const_cast<char*>(m_data), m_size);
+            throw std::runtime_error("Snapshot is truncated or corrupt: "
+                                     + filename);
+        }
+    }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    ~Snapshot() {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    stage_type stage() const {
+        return static_cast<stage_type>(m_header->stage);
+    }
+
+    std::size_t num_endpoints() const {
+        return section_size(endpoints_section);
+    }
+
+    std::size_t num_error_nodes() const {
+        return section_size(errors_section);
+    }
+
+    /***
+     * Fill the waterways, the node_map and the error_map of ds and the end
+     * node locations into the location index.
+     */
+    void restore(DataStorage &ds, index_pos_type &index_pos) const {
+        const DataStorage::WaterWay *waterways =
+                section_data<DataStorage::WaterWay>(waterways_section);
+        ds.restore_waterways(waterways,
+                             waterways + section_size(waterways_section),
+                             section_data<char>(names_section),
+                             section_size(names_section));
+
+        const EndpointRecord *endpoints =
+                section_data<EndpointRecord>(endpoints_section);
+        const uint64_t *way_indexes = section_data<uint64_t>(way_indexes_section);
+        for (std::size_t i = 0; i < num_endpoints(); ++i) {
+            const EndpointRecord &record = endpoints[i];
+            for (uint64_t j = 0; j < record.num_ways; ++j) {
+                ds.node_map.add_entry(EndpointIndex::Entry{record.node_id,
+                        way_indexes[record.first_way + j]});
+            }
+            const osmium::Location location(record.x, record.y);
+            if (location.valid() && record.node_id > 0) {
+                index_pos.set(static_cast<osmium::unsigned_object_id_type>(record.node_id),
+                              location);
+            }
+        }
+        index_pos.sort();
+
+        const ErrorRecord *errors = section_data<ErrorRecord>(errors_section);
+        for (std::size_t i = 0; i < num_error_nodes(); ++i) {
+            ds.add_error_node(errors[i].node_id, ErrorSum(errors[i].error_sum));
+        }
+    }
+
+    /***
+     * Call func with every stored polygon.
+     */
+    template <typename TFunc>
+    void for_each_polygon(TFunc &&func) const {
+        const PolygonRecord *polygons =
+                section_data<PolygonRecord>(polygons_section);
+        const FixedPolygon::Edge *edges =
+                section_data<FixedPolygon::Edge>(edges_section);
+        for (std::size_t i = 0; i < section_size(polygons_section); ++i) {
+            const FixedPolygon::Edge *first = edges + polygons[i].first_edge;
+            func(FixedPolygon(first, first + polygons[i].num_edges));
+        }
+    }
+};
+
+#endif /* SNAPSHOT_HPP_ */
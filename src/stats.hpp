@@ -0,0 +1,232 @@
+/***
+ * Stats collects metrics of every pass (wall and cpu time, peak RSS and
+ * arbitrary counters in named groups) and writes them as JSON for
+ * --stats FILE.
+ */
+
+#ifndef STATS_HPP_
+#define STATS_HPP_
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <osmium/handler.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "tagcheck.hpp"
+
+/***
+ * Counts the objects of a pass, put it first into the handler chain. With
+ * count_accepted set (--stats) it also counts the ways and relations each
+ * TagCheck predicate accepts, once per object.
+ */
+class ObjectCounter : public osmium::handler::Handler {
+
+public:
+
+    struct AcceptedCounts {
+        std::size_t is_waterway = 0;
+        std::size_t has_waterway_tag = 0;
+        std::size_t is_way_to_analyse = 0;
+        std::size_t is_area_to_analyse = 0;
+        std::size_t is_riverbank_or_coastline = 0;
+        std::size_t is_water_area = 0;
+
+        std::vector<std::pair<std::string, std::size_t>> values() const {
+            return {
+                {"is_waterway", is_waterway},
+                {"has_waterway_tag", has_waterway_tag},
+                {"is_way_to_analyse", is_way_to_analyse},
+                {"is_area_to_analyse", is_area_to_analyse},
+                {"is_riverbank_or_coastline", is_riverbank_or_coastline},
+                {"is_water_area", is_water_area}
+            };
+        }
+    };
+
+private:
+
+    void count(const osmium::OSMObject &object, bool is_relation) {
+        if (!count_accepted) {
+            return;
+        }
+        const TagClass tags = TagCheck::classify(object);
+        accepted.is_waterway += TagCheck::is_waterway(tags, is_relation);
+        accepted.has_waterway_tag += TagCheck::has_waterway_tag(tags);
+        accepted.is_way_to_analyse += TagCheck::is_way_to_analyse(tags);
+        accepted.is_area_to_analyse += TagCheck::is_area_to_analyse(tags);
+        accepted.is_riverbank_or_coastline +=
+                TagCheck::is_riverbank_or_coastline(tags);
+        accepted.is_water_area += TagCheck::is_water_area(tags);
+    }
+
+public:
+
+    bool count_accepted = false;
+    std::size_t nodes = 0;
+    std::size_t ways = 0;
+    std::size_t relations = 0;
+    AcceptedCounts accepted;
+
+    void node(const osmium::Node&) {
+        ++nodes;
+    }
+
+    void way(const osmium::Way &way) {
+        ++ways;
+        count(way, false);
+    }
+
+    void relation(const osmium::Relation &relation) {
+        ++relations;
+        count(relation, true);
+    }
+
+    void reset() {
+        nodes = 0;
+        ways = 0;
+        relations = 0;
+        accepted = AcceptedCounts();
+    }
+};
+
+class Stats {
+
+    struct Group {
+        std::string name;
+        std::vector<std::pair<std::string, double>> values;
+    };
+
+    struct Pass {
+        std::string name;
+        double wall_time = 0;
+        double cpu_time = 0;
+        long peak_rss_kb = 0;
+        std::vector<Group> groups;
+    };
+
+    std::vector<Pass> m_passes;
+    std::chrono::steady_clock::time_point m_wall_start;
+    double m_cpu_start = 0;
+
+    /***
+     * User and system time of all threads.
+     */
+    static double cpu_time() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+               + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    static void write_value(std::ostream &out, double value) {
+        if (value == std::floor(value) && std::fabs(value) < 1e15) {
+            out << static_cast<long long>(value);
+        } else {
+            out << value;
+        }
+    }
+
+    static void write_string(std::ostream &out, const std::string &str) {
+        out << '"';
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << '"';
+    }
+
+public:
+
+    /***
+     * Peak resident set size of the process in kB.
+     */
+    static long peak_rss_kb() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    void start_pass(const std::string &name) {
+        m_passes.emplace_back();
+        m_passes.back().name = name;
+        m_wall_start = std::chrono::steady_clock::now();
+        m_cpu_start = cpu_time();
+    }
+
+    void end_pass() {
+        Pass &pass = m_passes.back();
+        pass.wall_time = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - m_wall_start).count();
+        pass.cpu_time = cpu_time() - m_cpu_start;
+        pass.peak_rss_kb = peak_rss_kb();
+    }
+
+    /***
+     * Wall time of the last finished pass in seconds.
+     */
+    double wall_time() const {
+        return m_passes.back().wall_time;
+    }
+
+    /***
+     * Add a value to the group of the current (or last) pass.
+     */
+    void add(const std::string &group, const std::string &key, double value) {
+        std::vector<Group> &groups = m_passes.back().groups;
+        if (groups.empty() || groups.back().name != group) {
+            groups.emplace_back();
+            groups.back().name = group;
+        }
+        groups.back().values.emplace_back(key, value);
+    }
+
+    void write_json(std::ostream &out) const {
+        out << "{\n  \"passes\": [";
+        bool first_pass = true;
+        for (const auto& pass : m_passes) {
+            out << (first_pass ? "\n" : ",\n") << "    {\n      \"name\": ";
+            write_string(out, pass.name);
+            out << ",\n      \"wall_time\": " << pass.wall_time
+                << ",\n      \"cpu_time\": " << pass.cpu_time
+                << ",\n      \"peak_rss_kb\": " << pass.peak_rss_kb;
+            for (const auto& group : pass.groups) {
+                out << ",\n      ";
+                write_string(out, group.name);
+                out << ": {";
+                bool first_value = true;
+                for (const auto& value : group.values) {
+                    out << (first_value ? "" : ", ");
+                    write_string(out, value.first);
+                    out << ": ";
+                    write_value(out, value.second);
+                    first_value = false;
+                }
+                out << "}";
+            }
+            out << "\n    }";
+            first_pass = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    bool write(const std::string &filename) const {
+        std::ofstream out(filename);
+        if (!out) {
+            return false;
+        }
+        write_json(out);
+        return static_cast<bool>(out);
+    }
+};
+
+#endif /* STATS_HPP_ */
@@ -8,146 +8,423 @@
 #ifndef TAGCHECK_HPP_
 #define TAGCHECK_HPP_
 
+#include <cstring>
 #include <string>
+#include <utility>
+#include <vector>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/object.hpp>
 #include <osmium/osm/tag.hpp>
 #include <osmium/tags/filter.hpp>
 #include <osmium/tags/tags_filter.hpp>
 
 
+/***
+ * Classification of the tags of an object, filled by TagCheck::classify()
+ * with a single scan over the tag list. Pointers point into the tag list of
+ * the object and are only valid as long as the object. Like
+ * get_value_by_key() the first tag of a key wins.
+ */
+struct TagClass {
+
+    enum class waterway_type : char {
+        none = 0,
+        river,
+        stream,
+        drain,
+        brook,
+        canal,
+        ditch,
+        riverbank,
+        other
+    };
+
+    enum class natural_type : char {
+        none = 0,
+        water,
+        coastline,
+        other
+    };
+
+    enum class landuse_type : char {
+        none = 0,
+        reservoir,
+        basin,
+        other
+    };
+
+    enum class relation_type : char {
+        none = 0,
+        multipolygon,
+        waterway,
+        other
+    };
+
+    waterway_type waterway = waterway_type::none;
+    waterway_type water = waterway_type::none;
+    natural_type natural = natural_type::none;
+    landuse_type landuse = landuse_type::none;
+    relation_type type = relation_type::none;
+    bool bridge = false;
+    bool tunnel = false;
+    const char *landuse_value = nullptr;
+    const char *width = nullptr;
+    const char *est_width = nullptr;
+    const char *name = nullptr;
+};
+
 class TagCheck {
 
-    static const std::string get_waterway_type(const char *raw_type) {
-        if (!raw_type) {
-            return "";
-        }
-        if ((strcmp(raw_type, "river")) && (strcmp(raw_type, "stream")) 
-                && (strcmp(raw_type, "drain")) && (strcmp(raw_type, "brook"))
-                && (strcmp(raw_type, "canal")) && (strcmp(raw_type,"ditch"))
-                && (strcmp(raw_type, "riverbank"))) {
-            return "other";
-        } else {
-            return raw_type;
-        }
+    enum class key_type : char {
+        unknown = 0,
+        type,
+        waterway,
+        water,
+        natural,
+        landuse,
+        bridge,
+        tunnel,
+        width,
+        est_width,
+        name
+    };
+
+    static bool equal(const char *a, const char *b) {
+        return !strcmp(a, b);
     }
 
-public:
+    /***
+     * Dispatch on the first characters, at most one strcmp per key.
+     */
+    static key_type match_key(const char *key) {
+        switch (key[0]) {
+            case 'b':
+                return equal(key, "bridge") ? key_type::bridge : key_type::unknown;
+            case 'e':
+                return equal(key, "est_width") ? key_type::est_width : key_type::unknown;
+            case 'l':
+                return equal(key, "landuse") ? key_type::landuse : key_type::unknown;
+            case 'n':
+                if (key[1] != 'a') {
+                    return key_type::unknown;
+                }
+                if (key[2] == 'm') {
+                    return equal(key + 3, "e") ? key_type::name : key_type::unknown;
+                }
+                return equal(key + 2, "tural") ? key_type::natural : key_type::unknown;
+            case 't':
+                if (key[1] == 'y') {
+                    return equal(key + 2, "pe") ? key_type::type : key_type::unknown;
+                }
+                return equal(key + 1, "unnel") ? key_type::tunnel : key_type::unknown;
+            case 'w':
+                if (key[1] == 'i') {
+                    return equal(key + 2, "dth") ? key_type::width : key_type::unknown;
+                }
+                if (strncmp(key + 1, "ater", 4)) {
+                    return key_type::unknown;
+                }
+                if (key[5] == '\0') {
+                    return key_type::water;
+                }
+                return equal(key + 5, "way") ? key_type::waterway : key_type::unknown;
+            default:
+                return key_type::unknown;
+        }
+    }
 
-    static bool is_waterway(const osmium::OSMObject &osm_object,
-                            bool is_relation) {
-        const char* type = osm_object.get_value_by_key("type");
-        if ((type) && (!strcmp(type, "multipolygon"))) {
-            return false;
+    /***
+     * Values of the waterway and the water key.
+     */
+    static TagClass::waterway_type match_waterway_value(const char *value) {
+        typedef TagClass::waterway_type wt;
+        switch (value[0]) {
+            case 'b':
+                return equal(value, "brook") ? wt::brook : wt::other;
+            case 'c':
+                return equal(value, "canal") ? wt::canal : wt::other;
+            case 'd':
+                if (value[1] == 'i') {
+                    return equal(value + 2, "tch") ? wt::ditch : wt::other;
+                }
+                return equal(value + 1, "rain") ? wt::drain : wt::other;
+            case 'r':
+                if (strncmp(value + 1, "iver", 4)) {
+                    return wt::other;
+                }
+                if (value[5] == '\0') {
+                    return wt::river;
+                }
+                return equal(value + 5, "bank") ? wt::riverbank : wt::other;
+            case 's':
+                return equal(value, "stream") ? wt::stream : wt::other;
+            default:
+                return wt::other;
         }
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        if ((waterway) && (!strcmp(waterway, "riverbank"))) {
-            return false;
+    }
+
+    static TagClass::natural_type match_natural_value(const char *value) {
+        typedef TagClass::natural_type nt;
+        switch (value[0]) {
+            case 'c':
+                return equal(value, "coastline") ? nt::coastline : nt::other;
+            case 'w':
+                return equal(value, "water") ? nt::water : nt::other;
+            default:
+                return nt::other;
         }
-        if (is_relation) {
-            if ((type) && (!strcmp(type, "waterway"))) {
-                return true;
-            }
+    }
+
+    static TagClass::landuse_type match_landuse_value(const char *value) {
+        typedef TagClass::landuse_type lt;
+        switch (value[0]) {
+            case 'b':
+                return equal(value, "basin") ? lt::basin : lt::other;
+            case 'r':
+                return equal(value, "reservoir") ? lt::reservoir : lt::other;
+            default:
+                return lt::other;
         }
-        if (waterway) {
-            return true;
+    }
+
+    static TagClass::relation_type match_type_value(const char *value) {
+        typedef TagClass::relation_type rt;
+        switch (value[0]) {
+            case 'm':
+                return equal(value, "multipolygon") ? rt::multipolygon : rt::other;
+            case 'w':
+                return equal(value, "waterway") ? rt::waterway : rt::other;
+            default:
+                return rt::other;
         }
-        if (!is_relation) {
-            const char *natural = osm_object.get_value_by_key("natural");
-            if ((natural) && (!strcmp(natural, "coastline"))) {
-                return true;
-            }
+    }
+
+    static const char *waterway_type_name(TagClass::waterway_type type) {
+        switch (type) {
+            case TagClass::waterway_type::none:
+                return "";
+            case TagClass::waterway_type::river:
+                return "river";
+            case TagClass::waterway_type::stream:
+                return "stream";
+            case TagClass::waterway_type::drain:
+                return "drain";
+            case TagClass::waterway_type::brook:
+                return "brook";
+            case TagClass::waterway_type::canal:
+                return "canal";
+            case TagClass::waterway_type::ditch:
+                return "ditch";
+            case TagClass::waterway_type::riverbank:
+                return "riverbank";
+            default:
+                return "other";
         }
-        return false;
     }
 
-    static osmium::TagsFilter build_waterpolygon_filter() {
-        osmium::TagsFilter filter{false};
-        filter.add_rule(true, osmium::TagMatcher{"natural", "water"});
-        filter.add_rule(true, osmium::TagMatcher{"waterway"});
-        filter.add_rule(true, osmium::TagMatcher{"landuse", "reservoir"});
-        filter.add_rule(true, osmium::TagMatcher{"landuse", "basin"});
-        return filter;
+    /***
+     * Flowing water, excluded from the water polygons to analyse.
+     */
+    static bool is_flowing(TagClass::waterway_type type) {
+        switch (type) {
+            case TagClass::waterway_type::river:
+            case TagClass::waterway_type::drain:
+            case TagClass::waterway_type::stream:
+            case TagClass::waterway_type::canal:
+            case TagClass::waterway_type::ditch:
+            case TagClass::waterway_type::riverbank:
+                return true;
+            default:
+                return false;
+        }
     }
 
-    static bool has_waterway_tag(const osmium::OSMObject &osm_object) {
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        return static_cast<bool>(waterway);
+    static bool is_water_landuse(const TagClass &tags) {
+        return tags.landuse == TagClass::landuse_type::reservoir
+               || tags.landuse == TagClass::landuse_type::basin;
     }
 
-    static bool is_way_to_analyse(const osmium::OSMObject &osm_object) {
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        if (waterway) {
-            return true;
+    static bool match_waterway(const TagClass &tags, bool is_relation) {
+        if (tags.type == TagClass::relation_type::multipolygon) {
+            return false;
         }
-        //if ((waterway) && (!strcmp(waterway, "riverbank"))) {
-        //    return true;
-        //}
-        const char *natural = osm_object.get_value_by_key("natural");
-        if ((natural) && (!strcmp(natural, "coastline"))) {
-            return true;
+        if (tags.waterway == TagClass::waterway_type::riverbank) {
+            return false;
         }
-        if ((natural) && (!strcmp(natural, "water"))) {
+        if (is_relation && tags.type == TagClass::relation_type::waterway) {
             return true;
         }
-        const char* landuse = osm_object.get_value_by_key("landuse");
-        if ((landuse) && (!strcmp(landuse, "reservoir"))) {
+        if (tags.waterway != TagClass::waterway_type::none) {
             return true;
         }
-        if ((landuse) && (!strcmp(landuse, "basin"))) {
+        if (!is_relation && tags.natural == TagClass::natural_type::coastline) {
             return true;
         }
         return false;
     }
 
-    static bool is_area_to_analyse(const osmium::OSMObject &osm_object) {
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        if ((waterway)
-                && ((!strcmp(waterway, "river"))
-                 || (!strcmp(waterway, "drain"))
-                 || (!strcmp(waterway, "stream"))
-                 || (!strcmp(waterway, "canal"))
-                 || (!strcmp(waterway, "ditch"))
-                 || (!strcmp(waterway, "riverbank")))) {
-            return false;
-        }
-        const char *water = osm_object.get_value_by_key("water");
-        if ((water)
-                && ((!strcmp(water, "river"))
-                 || (!strcmp(water, "drain"))
-                 || (!strcmp(water, "stream"))
-                 || (!strcmp(water, "canal"))
-                 || (!strcmp(water, "ditch"))
-                 || (!strcmp(water, "riverbank")))) {
-            return false;
-        }
-        return true;
+    static bool match_has_waterway_tag(const TagClass &tags) {
+        return tags.waterway != TagClass::waterway_type::none;
     }
 
-    static bool is_riverbank_or_coastline(const osmium::OSMObject &osm_object) {
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        if ((waterway) && (!strcmp(waterway, "riverbank"))) {
+    static bool match_way_to_analyse(const TagClass &tags) {
+        if (tags.waterway != TagClass::waterway_type::none) {
             return true;
         }
-        const char *natural = osm_object.get_value_by_key("natural");
-        if ((natural) && (!strcmp(natural, "coastline"))) {
+        if (tags.natural == TagClass::natural_type::coastline
+                || tags.natural == TagClass::natural_type::water) {
             return true;
         }
-        return false;
+        return is_water_landuse(tags);
     }
 
-    static bool is_water_area(const osmium::OSMObject &osm_object) {
-        const char *natural = osm_object.get_value_by_key("natural");
-        if ((natural) && (!strcmp(natural, "water"))) {
+    static bool match_area_to_analyse(const TagClass &tags) {
+        return !is_flowing(tags.waterway) && !is_flowing(tags.water);
+    }
+
+    static bool match_riverbank_or_coastline(const TagClass &tags) {
+        return tags.waterway == TagClass::waterway_type::riverbank
+               || tags.natural == TagClass::natural_type::coastline;
+    }
+
+    static bool match_water_area(const TagClass &tags) {
+        if (tags.natural == TagClass::natural_type::water) {
             return true;
         }
-        const char *landuse = osm_object.get_value_by_key("landuse");
-        if ((landuse) && ((!strcmp(landuse, "reservoir")) ||
-                          (!strcmp(landuse, "basin")))){
+        if (is_water_landuse(tags)) {
             return true;
         }
-        if (osm_object.get_value_by_key("waterway")) {
-            return true;
+        return tags.waterway != TagClass::waterway_type::none;
+    }
+
+public:
+
+    /***
+     * Scan the tags of the object once, the predicates and getters below
+     * work on the result.
+     */
+    static TagClass classify(const osmium::OSMObject &osm_object) {
+        TagClass tags;
+        bool seen_waterway = false;
+        bool seen_water = false;
+        bool seen_natural = false;
+        bool seen_type = false;
+        for (const osmium::Tag &tag : osm_object.tags()) {
+            switch (match_key(tag.key())) {
+                case key_type::waterway:
+                    if (!seen_waterway) {
+                        tags.waterway = match_waterway_value(tag.value());
+                        seen_waterway = true;
+                    }
+                    break;
+                case key_type::water:
+                    if (!seen_water) {
+                        tags.water = match_waterway_value(tag.value());
+                        seen_water = true;
+                    }
+                    break;
+                case key_type::natural:
+                    if (!seen_natural) {
+                        tags.natural = match_natural_value(tag.value());
+                        seen_natural = true;
+                    }
+                    break;
+                case key_type::landuse:
+                    if (!tags.landuse_value) {
+                        tags.landuse = match_landuse_value(tag.value());
+                        tags.landuse_value = tag.value();
+                    }
+                    break;
+                case key_type::type:
+                    if (!seen_type) {
+                        tags.type = match_type_value(tag.value());
+                        seen_type = true;
+                    }
+                    break;
+                case key_type::bridge:
+                    tags.bridge = true;
+                    break;
+                case key_type::tunnel:
+                    tags.tunnel = true;
+                    break;
+                case key_type::width:
+                    if (!tags.width) {
+                        tags.width = tag.value();
+                    }
+                    break;
+                case key_type::est_width:
+                    if (!tags.est_width) {
+                        tags.est_width = tag.value();
+                    }
+                    break;
+                case key_type::name:
+                    if (!tags.name) {
+                        tags.name = tag.value();
+                    }
+                    break;
+                default:
+                    break;
+            }
         }
-        return false;
+        return tags;
+    }
+
+    static bool is_waterway(const TagClass &tags, bool is_relation) {
+        return match_waterway(tags, is_relation);
+    }
+
+    static bool is_waterway(const osmium::OSMObject &osm_object,
+                            bool is_relation) {
+        return is_waterway(classify(osm_object), is_relation);
+    }
+
+    static osmium::TagsFilter build_waterpolygon_filter() {
+        osmium::TagsFilter filter{false};
+        filter.add_rule(true, osmium::TagMatcher{"natural", "water"});
+        filter.add_rule(true, osmium::TagMatcher{"waterway"});
+        filter.add_rule(true, osmium::TagMatcher{"landuse", "reservoir"});
+        filter.add_rule(true, osmium::TagMatcher{"landuse", "basin"});
+        return filter;
+    }
+
+    static bool has_waterway_tag(const TagClass &tags) {
+        return match_has_waterway_tag(tags);
+    }
+
+    static bool has_waterway_tag(const osmium::OSMObject &osm_object) {
+        return has_waterway_tag(classify(osm_object));
+    }
+
+    static bool is_way_to_analyse(const TagClass &tags) {
+        return match_way_to_analyse(tags);
+    }
+
+    static bool is_way_to_analyse(const osmium::OSMObject &osm_object) {
+        return is_way_to_analyse(classify(osm_object));
+    }
+
+    static bool is_area_to_analyse(const TagClass &tags) {
+        return match_area_to_analyse(tags);
+    }
+
+    static bool is_area_to_analyse(const osmium::OSMObject &osm_object) {
+        return is_area_to_analyse(classify(osm_object));
+    }
+
+    static bool is_riverbank_or_coastline(const TagClass &tags) {
+        return match_riverbank_or_coastline(tags);
+    }
+
+    static bool is_riverbank_or_coastline(const osmium::OSMObject &osm_object) {
+        return is_riverbank_or_coastline(classify(osm_object));
+    }
+
+    static bool is_water_area(const TagClass &tags) {
+        return match_water_area(tags);
+    }
+
+    static bool is_water_area(const osmium::OSMObject &osm_object) {
+        return is_water_area(classify(osm_object));
     }
 
     static char get_waterway_category(const char *type) {
@@ -163,52 +440,59 @@ public:
         }
     }
 
-    static const std::string get_polygon_type(const osmium::Area &area) {
-        const char *natural = area.get_value_by_key("natural");
-        if ((natural) && (!strcmp(natural, "coastline"))) {
+    static const std::string get_polygon_type(const TagClass &tags) {
+        if (tags.natural == TagClass::natural_type::coastline) {
             return "coastline";
         }
-        if (get_waterway_type(area.get_value_by_key("waterway")).empty()) {
-            return area.get_value_by_key("landuse", "");
+        if (tags.waterway == TagClass::waterway_type::none) {
+            return tags.landuse_value ? tags.landuse_value : "";
         }
         return "";
     }
 
-    static const std::string get_way_type(const osmium::OSMObject &osm_object) {
-        const char *waterway = osm_object.get_value_by_key("waterway");
-        std::string type = get_waterway_type(waterway);
-        if (type.empty()) {
-            const char *natural = osm_object.get_value_by_key("natural");
-            if ((natural) && (!strcmp(natural, "coastline"))) {
+    static const std::string get_way_type(const TagClass &tags) {
+        if (tags.waterway == TagClass::waterway_type::none) {
+            if (tags.natural == TagClass::natural_type::coastline) {
                 return "coastline";
             } else {
                 return "";
             }
         }
-        return type;
+        return waterway_type_name(tags.waterway);
     }
 
-    static const char *get_width(const osmium::OSMObject &osm_object) {
-        const char *width = osm_object.get_value_by_key("width");
-        if (width) {
-            return width;
-        }
-        width = osm_object.get_value_by_key("est_width");
-        if (width) {
-            return width;
+    static const char *get_width(const TagClass &tags) {
+        if (tags.width) {
+            return tags.width;
         }
-        return width;
+        return tags.est_width;
     }
 
-    static const std::string get_construction(const osmium::OSMObject &osm_object) {
-        if (osm_object.get_value_by_key("bridge")) {
+    static const std::string get_construction(const TagClass &tags) {
+        if (tags.bridge) {
             return "bridge";
         }
-        if (osm_object.get_value_by_key("tunnel")) {
+        if (tags.tunnel) {
             return "tunnel";
         }
         return "";
     }
+
+    static const std::string get_polygon_type(const osmium::Area &area) {
+        return get_polygon_type(classify(area));
+    }
+
+    static const std::string get_way_type(const osmium::OSMObject &osm_object) {
+        return get_way_type(classify(osm_object));
+    }
+
+    static const char *get_width(const osmium::OSMObject &osm_object) {
+        return get_width(classify(osm_object));
+    }
+
+    static const std::string get_construction(const osmium::OSMObject &osm_object) {
+        return get_construction(classify(osm_object));
+    }
 };
 
 #endif /* TAGCHECK_HPP_ */
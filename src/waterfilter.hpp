@@ -0,0 +1,175 @@
+/***
+ * WaterFilter writes the water related objects of the input into a
+ * smaller PBF file (--prefilter), so the passes of the analysis do not
+ * decode the whole input again and again.
+ *   - reads the relations and keeps waterway and water polygon relations
+ *     with the ids of their member ways
+ *   - reads the ways and keeps the waterways, the water polygons and the
+ *     member ways with the ids of their nodes
+ *   - copies the kept objects into the output file
+ * The id sets use the positive ids, a negative id may keep the object with
+ * the same positive id too, which is harmless.
+ *
+ * The relation handlers of pass 1 run in the first pass, so the relations
+ * of the input are read only once. The output file is kept and can be
+ * used as input of later runs.
+ *
+ * With --water-locations only the first two passes run as part of pass 1,
+ * node_ids() then selects the nodes whose locations are stored.
+ */
+
+#ifndef WATERFILTER_HPP_
+#define WATERFILTER_HPP_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <osmium/handler.hpp>
+#include <osmium/index/id_set.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/any_output.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/tags/taglist.hpp>
+#include <osmium/tags/tags_filter.hpp>
+#include <osmium/visitor.hpp>
+
+#include "inputreader.hpp"
+#include "locationindex.hpp"
+#include "stats.hpp"
+#include "tagcheck.hpp"
+
+
+class WaterFilter : public osmium::handler::Handler {
+
+    osmium::TagsFilter m_filter;
+    node_id_set_type m_nodes;
+    node_id_set_type m_ways;
+    node_id_set_type m_relations;
+
+    /***
+     * The tags of the objects any of the passes is interested in: the water
+     * polygons, the coastline and the waterway relations.
+     */
+    static osmium::TagsFilter build_filter() {
+        osmium::TagsFilter filter = TagCheck::build_waterpolygon_filter();
+        filter.add_rule(true, osmium::TagMatcher{"natural", "coastline"});
+        filter.add_rule(true, osmium::TagMatcher{"type", "waterway"});
+        return filter;
+    }
+
+    bool is_kept(const osmium::OSMObject &object) const {
+        switch (object.type()) {
+        case osmium::item_type::node:
+            return m_nodes.get(object.positive_id());
+        case osmium::item_type::way:
+            return m_ways.get(object.positive_id());
+        case osmium::item_type::relation:
+            return m_relations.get(object.positive_id());
+        default:
+            return false;
+        }
+    }
+
+    /***
+     * Copy the kept objects of all buffers of input into output.
+     */
+    std::size_t copy_kept(InputReader &input,
+                          const std::string &input_filename,
+                          const std::string &output_filename,
+                          ObjectCounter &object_counter) {
+        std::unique_ptr<osmium::io::Reader> reader = input.open(input_filename);
+        osmium::io::Header header = reader->header();
+        header.set("generator", "osmi_water --prefilter");
+        osmium::io::Writer writer(osmium::io::File(output_filename, "pbf"),
+                                  header, osmium::io::overwrite::allow);
+        std::size_t kept = 0;
+        while (osmium::memory::Buffer buffer = reader->read()) {
+            osmium::apply(buffer, object_counter);
+            osmium::memory::Buffer output(buffer.committed(),
+                    osmium::memory::Buffer::auto_grow::yes);
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (is_kept(object)) {
+                    output.add_item(object);
+                    output.commit();
+                    ++kept;
+                }
+            }
+            writer(std::move(output));
+        }
+        writer.close();
+        input.close(*reader);
+        return kept;
+    }
+
+public:
+
+    WaterFilter() :
+            m_filter(build_filter()) {
+    }
+
+    void relation(const osmium::Relation &relation) {
+        if (!osmium::tags::match_any_of(relation.tags(), m_filter)) {
+            return;
+        }
+        m_relations.set(relation.positive_id());
+        for (const auto& member : relation.members()) {
+            if (member.type() == osmium::item_type::way) {
+                m_ways.set(member.positive_ref());
+            }
+        }
+    }
+
+    void way(const osmium::Way &way) {
+        if (!m_ways.get(way.positive_id())) {
+            if (!osmium::tags::match_any_of(way.tags(), m_filter)) {
+                return;
+            }
+            m_ways.set(way.positive_id());
+        }
+        for (const auto& node_ref : way.nodes()) {
+            m_nodes.set(node_ref.positive_ref());
+        }
+    }
+
+    /***
+     * Run the three passes and write the kept objects of input_filename
+     * into the PBF file output_filename. The relation_handlers get all
+     * relations of the input. Returns the number of kept objects.
+     */
+    template <typename... THandlers>
+    std::size_t write(InputReader &input, const std::string &input_filename,
+                      const std::string &output_filename,
+                      ObjectCounter &object_counter,
+                      THandlers&... relation_handlers) {
+        std::unique_ptr<osmium::io::Reader> relation_reader = input.open(
+                input_filename, osmium::osm_entity_bits::relation);
+        osmium::apply(*relation_reader, object_counter, *this,
+                      relation_handlers...);
+        input.close(*relation_reader);
+
+        std::unique_ptr<osmium::io::Reader> way_reader = input.open(
+                input_filename, osmium::osm_entity_bits::way);
+        osmium::apply(*way_reader, object_counter, *this);
+        input.close(*way_reader);
+
+        return copy_kept(input, input_filename, output_filename,
+                         object_counter);
+    }
+
+    /***
+     * The nodes of the kept ways, complete after the ways are read.
+     */
+    const node_id_set_type& node_ids() const {
+        return m_nodes;
+    }
+
+    std::size_t used_memory() const {
+        return m_nodes.used_memory() + m_ways.used_memory()
+               + m_relations.used_memory();
+    }
+};
+
+#endif /* WATERFILTER_HPP_ */
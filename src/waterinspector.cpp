@@ -1,10 +1,10 @@
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <getopt.h>
 #include <iterator>
 #include <vector>
 
-#include <osmium/index/map/sparse_mem_array.hpp>
-
 #include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/visitor.hpp>
 #include <osmium/area/multipolygon_manager.hpp>
@@ -14,53 +14,384 @@
 #include <osmium/osm/relation.hpp>
 #include <osmium/osm/tag.hpp>
 #include <osmium/tags/filter.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/file.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/relations/collector.hpp>
 #include <osmium/memory/buffer.hpp>
 #include <osmium/geom/ogr.hpp>
-#include <osmium/geom/geos.hpp>
 #include <osmium/geom/wkt.hpp>
 #include <boost/algorithm/string/predicate.hpp>
-#include <geos/geom/GeometryCollection.h>
-#include <geos/geom/PrecisionModel.h>
-#include <geos/geom/GeometryFactory.h>
-#include <geos/index/strtree/STRtree.h>
-#include <geos/io/WKBWriter.h>
 
 #include "errorsum.hpp"
+#include "locationindex.hpp"
 #include "waterway.hpp"
 //#include "waterpolygon.hpp"
 #include "tagcheck.hpp"
 #include "datastorage.hpp"
+#include "inputreader.hpp"
 #include "falsepositives.hpp"
 #include "areahandler.hpp"
+#include "changestate.hpp"
+#include "changeupdater.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "waterfilter.hpp"
+
+/***
+ * Add the metrics of the pass just finished to stats. Counters growing over
+ * the whole run are stored as difference to the previous pass.
+ */
+void add_pass_stats(Stats &stats, ObjectCounter &object_counter,
+                    InputReader &input,
+                    DataStorage &ds, const index_pos_type &index_pos,
+                    DataStorage::InsertStats &inserted_before) {
+    stats.end_pass();
+
+    stats.add("objects_read", "nodes", object_counter.nodes);
+    stats.add("objects_read", "ways", object_counter.ways);
+    stats.add("objects_read", "relations", object_counter.relations);
+    const std::size_t bytes_read = input.take_bytes_read();
+    const double wall_time = stats.wall_time();
+    stats.add("read", "bytes", bytes_read);
+    stats.add("read", "mb_per_second", wall_time > 0
+              ? bytes_read / wall_time / (1024 * 1024) : 0);
+    stats.add("read", "objects_per_second", wall_time > 0
+              ? (object_counter.nodes + object_counter.ways
+                 + object_counter.relations) / wall_time : 0);
+    for (const auto& accepted : object_counter.accepted.values()) {
+        stats.add("tagcheck_accepted", accepted.first, accepted.second);
+    }
+    object_counter.reset();
 
-typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type,
-        osmium::Location> index_neg_type;
-typedef osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type,
-                                           osmium::Location>
-        index_pos_type;
-typedef osmium::handler::NodeLocationsForWays<index_pos_type, index_neg_type>
-        location_handler_type;
-typedef geos::geom::LineString linestring_type;
+    const DataStorage::InsertStats &inserted = ds.insert_stats();
+    stats.add("features_inserted", "polygons",
+              inserted.polygons - inserted_before.polygons);
+    stats.add("features_inserted", "relations",
+              inserted.relations - inserted_before.relations);
+    stats.add("features_inserted", "ways",
+              inserted.ways - inserted_before.ways);
+    stats.add("features_inserted", "nodes",
+              inserted.nodes - inserted_before.nodes);
+    stats.add("writer", "queue_full_waits",
+              inserted.queue_full_waits - inserted_before.queue_full_waits);
+    stats.add("writer", "queue_wait_seconds",
+              std::chrono::duration<double>(inserted.queue_wait_time
+                      - inserted_before.queue_wait_time).count());
+    inserted_before = inserted;
+
+    stats.add("sizes", "node_map", ds.node_map.size());
+    stats.add("sizes", "node_map_bytes", ds.node_map.used_memory());
+    stats.add("sizes", "node_map_spilled", ds.node_map.spilled_entries());
+    stats.add("sizes", "waterway_names", ds.names().size());
+    stats.add("sizes", "error_map", ds.error_map.size());
+    stats.add("sizes", "error_filter_bytes", ds.error_filter.used_memory());
+    stats.add("sizes", "fixed_polygon_set", ds.fixed_polygon_set.size());
+    stats.add("sizes", "polygon_tree_bytes", ds.polygon_tree.used_memory());
+    stats.add("sizes", "location_index", index_pos.size());
+    stats.add("sizes", "location_index_bytes", index_pos.used_memory());
+}
 
 void print_help() {
     std::cout << "osmi [OPTIONS] INFILE OUTFILE\n\n"
-            << "  -h, --help           This help message\n"
-            //<< "  -d, --debug          Enable debug output !NOT IN USE\n"
+            << "  -h, --help              This help message\n"
+            //<< "  -d, --debug             Enable debug output !NOT IN USE\n"
+            << "  -i, --index-type=TYPE   Node location index type (default: "
+            << LocationIndex::default_type() << ")\n"
+            << "  -I, --show-index-types  List available index types\n"
+            << "  -2, --two-pass          Read the input twice instead of three\n"
+            << "                          times, keeps the way nodes to check\n"
+            << "                          in memory\n"
+            << "  -t, --threads=N         Number of worker threads, also used\n"
+            << "                          to decode the input (default:\n"
+            << "                          osmium default)\n"
+            << "  -r, --read-queue=N      Number of buffers read ahead from\n"
+            << "                          the input (default: osmium default)\n"
+            << "  -a, --analyse-threads=N Analyse the end nodes and look up\n"
+            << "                          their locations in N ranges of node\n"
+            << "                          ids on the worker threads (default:\n"
+            << "                          1, serial)\n"
+            << "  -c, --commit-every=N    Commit the output database after N\n"
+            << "                          inserted features (default: 10000,\n"
+            << "                          0: no explicit transactions)\n"
+            << "  -q, --write-queue=N     Number of features queued for the\n"
+            << "                          writer thread (default: 10000,\n"
+            << "                          0: write in the reading thread)\n"
+            << "  -F, --no-finalize       Do not sort the tables and build\n"
+            << "                          their indexes at the end\n"
+            << "  -s, --stats=FILE        Write metrics of every pass as JSON\n"
+            << "  -S, --state=FILE        Write the state needed by --update,\n"
+            << "                          with --update read and update it\n"
+            << "  -u, --update            INFILE is a change file, update\n"
+            << "                          OUTFILE of a previous run with\n"
+            << "                          --state and -i dense_file_array,FILE,\n"
+            << "                          refuses changes of water polygons\n"
+            << "                          and relations\n"
+            << "  -P, --snapshot=FILE     Write a snapshot of the analysis\n"
+            << "                          after pass 2 and after pass 3\n"
+            << "  -R, --resume=FILE       Continue the run that wrote the\n"
+            << "                          snapshot FILE into OUTFILE\n"
+            << "  -f, --prefilter=FILE    Write the water objects of INFILE\n"
+            << "                          into the PBF file FILE first and\n"
+            << "                          read it in the passes, FILE is\n"
+            << "                          kept and can be INFILE of later\n"
+            << "                          runs\n"
+            << "  -m, --memory-limit=MB   Keep at most MB of end node entries\n"
+            << "                          in memory, spill the rest into\n"
+            << "                          temporary files (TMPDIR)\n"
+            << "  -l, --water-locations   Store only the locations of the\n"
+            << "                          nodes of water ways, reads the\n"
+            << "                          ways in pass 1 to find them\n"
             << std::endl;
 }
 
+bool is_persistent_index(const std::string &index_type) {
+    return boost::starts_with(index_type, "dense_file_array,");
+}
+
+/***
+ * Update mode: apply the change file to the output and the state of a
+ * previous run. Only the ways and the nodes tables are updated, change
+ * files that need more are refused before anything is written.
+ */
+int update_output(const std::string &input_filename,
+                  const std::string &output_filename,
+                  const std::string &state_filename,
+                  index_pos_type &index_pos, osmium::thread::Pool &pool,
+                  std::size_t commit_every,
+                  const std::string &stats_filename) {
+    ChangeState change_state;
+    std::unique_ptr<DataStorage> ds;
+    try {
+        change_state.read(state_filename);
+        ds.reset(new DataStorage(output_filename, commit_every, true));
+    } catch (std::runtime_error& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
+    ds->record_change_state(change_state);
+    InputReader input(pool);
+
+    index_neg_type index_neg;
+    location_handler_type location_handler(index_pos, index_neg);
+    location_handler.ignore_errors();
+    WaterwayCollector waterway_collector(location_handler, *ds);
+    IndicateFalsePositives indicate_false_positives(*ds, location_handler,
+                                                    pool);
+    ChangeUpdater updater(*ds, change_state, location_handler,
+                          waterway_collector, indicate_false_positives);
+
+    Stats stats;
+    ObjectCounter object_counter;
+    object_counter.count_accepted = !stats_filename.empty();
+    DataStorage::InsertStats inserted_before;
+
+    std::cerr << "Reading change file...\n";
+    stats.start_pass("update_read");
+    std::unique_ptr<osmium::io::Reader> reader = input.open(input_filename,
+            osmium::osm_entity_bits::nwr);
+    osmium::apply(*reader, object_counter, updater);
+    input.close(*reader);
+    if (!updater.check()) {
+        std::cerr << "--update can not apply this change file, run a full "
+                  << "analysis instead\n";
+        return 1;
+    }
+    add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                   inserted_before);
+
+    std::cerr << "Updating ways...\n";
+    stats.start_pass("update_ways");
+    updater.update_locations();
+    index_pos.sort();
+    updater.update_ways();
+    add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                   inserted_before);
+
+    std::cerr << "Updating nodes...\n";
+    stats.start_pass("update_nodes");
+    updater.update_nodes();
+    ds->commit();
+    add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                   inserted_before);
+    ds->report_insert_stats(std::cerr);
+
+    try {
+        change_state.write(state_filename);
+    } catch (std::runtime_error& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
+    if (!stats_filename.empty() && !stats.write(stats_filename)) {
+        std::cerr << "Failed to write stats to " << stats_filename << '\n';
+    }
+    std::cout << "ready\n";
+    return 0;
+}
+
+/***
+ * Write a snapshot after committing the output, so the snapshot never
+ * refers to rows lost with an open transaction.
+ */
+void write_snapshot(const std::string &snapshot_filename,
+                    Snapshot::stage_type stage, DataStorage &ds,
+                    location_handler_type &location_handler) {
+    if (snapshot_filename.empty()) {
+        return;
+    }
+    ds.commit();
+    try {
+        Snapshot::write(snapshot_filename, stage, ds, location_handler);
+    } catch (std::runtime_error& err) {
+        std::cerr << err.what() << '\n';
+    }
+}
+
+/***
+ * Resume mode: restore the analysis state of the snapshot and run the
+ * remaining stages into OUTFILE. A stage 2 snapshot repeats the node
+ * analysis and pass 3, a stage 3 snapshot only the output.
+ */
+int resume_output(const std::string &input_filename,
+                  const std::string &output_filename,
+                  const std::string &snapshot_filename,
+                  index_pos_type &index_pos, osmium::thread::Pool &pool,
+                  std::size_t commit_every, std::size_t write_queue,
+                  std::size_t analyse_threads, bool finalize,
+                  const std::string &stats_filename) {
+    std::unique_ptr<Snapshot> snapshot;
+    std::unique_ptr<DataStorage> ds;
+    try {
+        snapshot.reset(new Snapshot(snapshot_filename));
+        ds.reset(new DataStorage(output_filename, commit_every, true));
+    } catch (std::runtime_error& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
+    ds->start_writer(write_queue);
+    InputReader input(pool);
+
+    index_neg_type index_neg;
+    location_handler_type location_handler(index_pos, index_neg);
+    location_handler.ignore_errors();
+    WaterwayCollector waterway_collector(location_handler, *ds);
+    AreaHandler area_handler(*ds, pool);
+    IndicateFalsePositives indicate_false_positives(*ds, location_handler,
+                                                    pool);
+
+    Stats stats;
+    ObjectCounter object_counter;
+    object_counter.count_accepted = !stats_filename.empty();
+    DataStorage::InsertStats inserted_before;
+
+    std::cerr << "Restoring snapshot of stage " << snapshot->stage()
+              << "...\n";
+    stats.start_pass("resume");
+    snapshot->restore(*ds, index_pos);
+    if (snapshot->stage() == Snapshot::after_pass2) {
+        snapshot->for_each_polygon([&area_handler]
+                (FixedPolygon &&polygon) {
+            area_handler.add_polygon(std::move(polygon));
+        });
+    }
+    add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                   inserted_before);
+
+    if (snapshot->stage() == Snapshot::after_pass2) {
+        std::cerr << "Pass 3...\n";
+        stats.start_pass("pass3");
+        ds->delete_analysed_node_features();
+        waterway_collector.analyse_nodes(pool, analyse_threads);
+        std::unique_ptr<osmium::io::Reader> reader3 = input.open(
+                input_filename, osmium::osm_entity_bits::way);
+        osmium::apply(*reader3, object_counter, indicate_false_positives);
+        input.close(*reader3);
+        area_handler.complete_polygon_tree();
+        indicate_false_positives.check_area();
+        add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                       inserted_before);
+        std::cerr << "Pass 3 done\n";
+    } else {
+        std::vector<osmium::object_id_type> error_nodes;
+        for (const auto& error_node : ds->error_map) {
+            error_nodes.push_back(error_node.first);
+        }
+        ds->delete_node_features(error_nodes);
+    }
+    snapshot.reset();
+
+    stats.start_pass("output");
+    ds->insert_error_nodes(location_handler);
+    ds->commit();
+    add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                   inserted_before);
+    ds->report_insert_stats(std::cerr);
+
+    if (finalize) {
+        std::cerr << "Finalizing output...\n";
+        stats.start_pass("finalize");
+        ds->finalize(pool);
+        add_pass_stats(stats, object_counter, input, *ds, index_pos,
+                       inserted_before);
+    }
+
+    if (!stats_filename.empty() && !stats.write(stats_filename)) {
+        std::cerr << "Failed to write stats to " << stats_filename << '\n';
+    }
+    std::cout << "ready\n";
+    return 0;
+}
+
+void print_index_types() {
+    for (const auto& type : LocationIndex::available_types()) {
+        std::cout << type << '\n';
+    }
+}
+
 int main(int argc, char* argv[]) {
-    static struct option long_options[] = { { "help", no_argument, 0, 'h' }, {
-            "debug", no_argument, 0, 'd' }, { 0, 0, 0, 0 } };
+    static struct option long_options[] = {
+            { "help", no_argument, 0, 'h' },
+            { "debug", no_argument, 0, 'd' },
+            { "index-type", required_argument, 0, 'i' },
+            { "show-index-types", no_argument, 0, 'I' },
+            { "two-pass", no_argument, 0, '2' },
+            { "threads", required_argument, 0, 't' },
+            { "read-queue", required_argument, 0, 'r' },
+            { "analyse-threads", required_argument, 0, 'a' },
+            { "commit-every", required_argument, 0, 'c' },
+            { "write-queue", required_argument, 0, 'q' },
+            { "no-finalize", no_argument, 0, 'F' },
+            { "stats", required_argument, 0, 's' },
+            { "state", required_argument, 0, 'S' },
+            { "update", no_argument, 0, 'u' },
+            { "snapshot", required_argument, 0, 'P' },
+            { "resume", required_argument, 0, 'R' },
+            { "prefilter", required_argument, 0, 'f' },
+            { "water-locations", no_argument, 0, 'l' },
+            { "memory-limit", required_argument, 0, 'm' },
+            { 0, 0, 0, 0 } };
 
     bool debug = false;
+    bool two_pass = false;
+    int num_threads = 0;
+    std::size_t read_queue = 0;
+    std::size_t analyse_threads = 1;
+    std::size_t commit_every = 10000;
+    std::size_t write_queue = 10000;
+    bool finalize = true;
+    std::string stats_filename;
+    std::string state_filename;
+    bool update = false;
+    std::string snapshot_filename;
+    std::string resume_filename;
+    std::string prefilter_filename;
+    bool water_locations = false;
+    std::size_t memory_limit = 0;
+    std::string index_type = LocationIndex::default_type();
 
     while (true) {
-        int c = getopt_long(argc, argv, "hd:", long_options, 0);
+        int c = getopt_long(argc, argv, "hd:i:I2t:r:a:c:q:Fs:S:uP:R:f:lm:", long_options, 0);
         if (c == -1) {
             break;
         }
@@ -72,6 +403,57 @@ int main(int argc, char* argv[]) {
         case 'd':
             debug = true;
             break;
+        case 'i':
+            index_type = optarg;
+            break;
+        case 'I':
+            print_index_types();
+            exit(0);
+        case '2':
+            two_pass = true;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'r':
+            read_queue = strtoul(optarg, nullptr, 10);
+            break;
+        case 'a':
+            analyse_threads = strtoul(optarg, nullptr, 10);
+            break;
+        case 'c':
+            commit_every = strtoul(optarg, nullptr, 10);
+            break;
+        case 'q':
+            write_queue = strtoul(optarg, nullptr, 10);
+            break;
+        case 'F':
+            finalize = false;
+            break;
+        case 's':
+            stats_filename = optarg;
+            break;
+        case 'S':
+            state_filename = optarg;
+            break;
+        case 'u':
+            update = true;
+            break;
+        case 'P':
+            snapshot_filename = optarg;
+            break;
+        case 'R':
+            resume_filename = optarg;
+            break;
+        case 'f':
+            prefilter_filename = optarg;
+            break;
+        case 'l':
+            water_locations = true;
+            break;
+        case 'm':
+            memory_limit = strtoul(optarg, nullptr, 10) * 1024 * 1024;
+            break;
         default:
             exit(1);
         }
@@ -92,10 +474,73 @@ int main(int argc, char* argv[]) {
         input_filename = "-";
     }
 
-    DataStorage ds(output_filename);
-    index_pos_type index_pos;
+    if (update && (state_filename.empty()
+                   || !is_persistent_index(index_type))) {
+        std::cerr << "--update needs --state and the location index of the "
+                  << "previous run (-i dense_file_array,FILE)\n";
+        exit(1);
+    }
+    if (!state_filename.empty() && !is_persistent_index(index_type)) {
+        std::cerr << "Warning: without -i dense_file_array,FILE the state "
+                  << "can not be used for --update\n";
+    }
+
+    if (!resume_filename.empty() && (update || !state_filename.empty())) {
+        std::cerr << "--resume can not be combined with --update or "
+                  << "--state\n";
+        exit(1);
+    }
+    if (!prefilter_filename.empty() && (update || !state_filename.empty()
+                                        || !resume_filename.empty())) {
+        std::cerr << "--prefilter can not be combined with --update, "
+                  << "--state or --resume\n";
+        exit(1);
+    }
+    if (water_locations && (update || !state_filename.empty()
+                            || !resume_filename.empty())) {
+        std::cerr << "--water-locations can not be combined with --update, "
+                  << "--state or --resume\n";
+        exit(1);
+    }
+    if (memory_limit && (update || !resume_filename.empty())) {
+        std::cerr << "--memory-limit can not be combined with --update or "
+                  << "--resume\n";
+        exit(1);
+    }
+
+    std::unique_ptr<index_pos_type> index_pos;
+    try {
+        index_pos = LocationIndex::create(index_type);
+    } catch (osmium::map_factory_error& err) {
+        std::cerr << err.what() << '\n'
+                  << "Use --show-index-types to list the available types.\n";
+        exit(1);
+    }
+
+    osmium::thread::Pool pool(num_threads);
+    InputReader::set_queue_size(read_queue);
+    if (update) {
+        return update_output(input_filename, output_filename,
+                             state_filename, *index_pos, pool, commit_every,
+                             stats_filename);
+    }
+    if (!resume_filename.empty()) {
+        return resume_output(input_filename, output_filename,
+                             resume_filename, *index_pos, pool, commit_every,
+                             write_queue, analyse_threads, finalize,
+                             stats_filename);
+    }
+
+    DataStorage ds(output_filename, commit_every);
+    ds.start_writer(write_queue);
+    ds.node_map.set_memory_limit(memory_limit);
+    InputReader input(pool);
+    ChangeState change_state;
+    if (!state_filename.empty()) {
+        ds.record_change_state(change_state);
+    }
     index_neg_type index_neg;
-    location_handler_type location_handler(index_pos, index_neg);
+    location_handler_type location_handler(*index_pos, index_neg);
     location_handler.ignore_errors();
     //location_handler_type location_handler_area(index_pos, index_neg);
     //location_handler_area.ignore_errors();
@@ -105,50 +550,174 @@ int main(int argc, char* argv[]) {
     WaterwayCollector waterway_collector(location_handler, ds);
     osmium::area::MultipolygonManager<osmium::area::Assembler> waterpolygon_collector(assembler_config, TagCheck::build_waterpolygon_filter());
 
+    Stats stats;
+    ObjectCounter object_counter;
+    object_counter.count_accepted = !stats_filename.empty();
+    DataStorage::InsertStats inserted_before;
+
+    /***
+     * Prefilter: copy the water objects into a smaller file, read by all
+     * following passes instead of the input. The relations of pass 1 are
+     * collected while the prefilter reads them.
+     */
+    std::unique_ptr<WaterFilter> water_filter;
+    if (!prefilter_filename.empty()) {
+        std::cerr << "Prefilter...\n";
+        stats.start_pass("prefilter");
+        water_filter.reset(new WaterFilter());
+        const std::size_t kept = water_filter->write(input, input_filename,
+                prefilter_filename, object_counter, waterway_collector,
+                waterpolygon_collector);
+        add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                       inserted_before);
+        stats.add("prefilter", "objects_kept", kept);
+        stats.add("prefilter", "id_sets_bytes", water_filter->used_memory());
+        input_filename = prefilter_filename;
+        std::cerr << "Prefilter done\n";
+    }
+
     /***
      * Pass 1: waterway_collector and waterpolygon_collector remember the ways
-     * according to a relation.
+     * according to a relation. With --water-locations the ways are read
+     * too, to find the nodes whose locations are needed. After the
+     * prefilter both is done already.
      */
     std::cerr << "Pass 1...\n";
-    osmium::relations::read_relations(osmium::io::File(input_filename), waterway_collector, waterpolygon_collector);
+    stats.start_pass("pass1");
+    std::unique_ptr<WaterFilter> location_filter;
+    if (water_filter) {
+        if (water_locations) {
+            location_filter = std::move(water_filter);
+        }
+        water_filter.reset();
+    } else if (water_locations) {
+        std::unique_ptr<osmium::io::Reader> reader1 = input.open(
+                input_filename, osmium::osm_entity_bits::relation);
+        location_filter.reset(new WaterFilter());
+        osmium::apply(*reader1, object_counter, waterway_collector,
+                      waterpolygon_collector, *location_filter);
+        input.close(*reader1);
+        std::unique_ptr<osmium::io::Reader> way_reader1 = input.open(
+                input_filename, osmium::osm_entity_bits::way);
+        osmium::apply(*way_reader1, object_counter, *location_filter);
+        input.close(*way_reader1);
+    } else {
+        std::unique_ptr<osmium::io::Reader> reader1 = input.open(
+                input_filename, osmium::osm_entity_bits::relation);
+        osmium::apply(*reader1, object_counter, waterway_collector, waterpolygon_collector);
+        input.close(*reader1);
+    }
+    waterway_collector.prepare_for_lookup();
+    waterpolygon_collector.prepare_for_lookup();
+    add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                   inserted_before);
+    if (location_filter) {
+        stats.add("water_locations", "id_sets_bytes",
+                  location_filter->used_memory());
+    }
     std::cerr << "Pass 1 done\n";;
 
     /***
      * Pass 2: Collect all waterways in and not in any relation.
      * Insert features to ways and relations table.
      * analyse_nodes is detecting all possibly errors and mouths.
+     * In two pass mode the way nodes for pass 3 are recorded here.
      */
     std::cerr << "Pass 2...\n";
-    AreaHandler area_handler(ds);
-    osmium::io::Reader reader2(input_filename);
-    osmium::apply(reader2, location_handler, waterway_collector.handler(),
-                  waterpolygon_collector.handler(
-                      [&area_handler]
-                      (const osmium::memory::Buffer &area_buffer) {
-                          osmium::apply(area_buffer, area_handler);
-                  }));
+    stats.start_pass("pass2");
+    AreaHandler area_handler(ds, pool);
+    IndicateFalsePositives indicate_false_positives(ds, location_handler,
+                                                    pool, two_pass);
+    auto area_callback = [&area_handler]
+                         (osmium::memory::Buffer &&area_buffer) {
+                             area_handler.add_buffer(std::move(area_buffer));
+                         };
+    FilteredLocationHandler filtered_location_handler(location_handler,
+            location_filter ? &location_filter->node_ids() : nullptr);
+    std::unique_ptr<osmium::io::Reader> reader2 = input.open(input_filename,
+            osmium::osm_entity_bits::node | osmium::osm_entity_bits::way);
+    if (two_pass) {
+        osmium::apply(*reader2, object_counter, filtered_location_handler,
+                      waterway_collector.handler(),
+                      waterpolygon_collector.handler(area_callback),
+                      indicate_false_positives);
+    } else {
+        osmium::apply(*reader2, object_counter, filtered_location_handler,
+                      waterway_collector.handler(),
+                      waterpolygon_collector.handler(area_callback));
+    }
+    area_handler.flush();
+    location_filter.reset();
     waterway_collector.ways_in_incomplete_relation();
-    waterway_collector.analyse_nodes();
-    reader2.close();
+    write_snapshot(snapshot_filename, Snapshot::after_pass2, ds,
+                   location_handler);
+    waterway_collector.analyse_nodes(pool, analyse_threads);
+    input.close(*reader2);
+    add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                   inserted_before);
+    if (two_pass) {
+        stats.add("sizes", "recorded_visits",
+                  indicate_false_positives.recorded_visits().size());
+        stats.add("sizes", "recorded_visits_bytes",
+                  indicate_false_positives.recorded_visits().used_memory());
+    }
     std::cerr << "Pass 2 done\n";
 
     /***
      * Pass 3: Indicate false positives by comparing the error nodes with the
-     * way nodes between the firstnode and the lastnode.
+     * way nodes between the firstnode and the lastnode. In two pass mode
+     * the way nodes recorded in pass 2 are used instead of reading the input.
      */
     std::cerr << "Pass 3...\n";
-    osmium::io::Reader reader3(input_filename, osmium::osm_entity_bits::way);
-    IndicateFalsePositives indicate_false_positives(ds, location_handler);
-    osmium::apply(reader3, indicate_false_positives);
-    reader3.close();
+    stats.start_pass("pass3");
+    if (two_pass) {
+        indicate_false_positives.check_recorded_nodes();
+    } else {
+        std::unique_ptr<osmium::io::Reader> reader3 = input.open(
+                input_filename, osmium::osm_entity_bits::way);
+        osmium::apply(*reader3, object_counter, indicate_false_positives);
+        input.close(*reader3);
+    }
     area_handler.complete_polygon_tree();
     indicate_false_positives.check_area();
+    write_snapshot(snapshot_filename, Snapshot::after_pass3, ds,
+                   location_handler);
+    add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                   inserted_before);
     std::cerr << "Pass 3 done\n";
 
     /***
      * Insert the error nodes into the nodes table.
      */
+    stats.start_pass("output");
     ds.insert_error_nodes(location_handler);
+    ds.commit();
+    add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                   inserted_before);
+    ds.report_insert_stats(std::cerr);
+
+    /***
+     * Sort the tables and build the indexes used by the map.
+     */
+    if (finalize) {
+        std::cerr << "Finalizing output...\n";
+        stats.start_pass("finalize");
+        ds.finalize(pool);
+        add_pass_stats(stats, object_counter, input, ds, *index_pos,
+                       inserted_before);
+    }
+
+    if (!state_filename.empty()) {
+        try {
+            change_state.write(state_filename);
+        } catch (std::runtime_error& err) {
+            std::cerr << err.what() << '\n';
+        }
+    }
+
+    if (!stats_filename.empty() && !stats.write(stats_filename)) {
+        std::cerr << "Failed to write stats to " << stats_filename << '\n';
+    }
 
     std::cout << "ready\n";
 }
@@ -6,28 +6,20 @@
 #ifndef WATERWAY_HPP_
 #define WATERWAY_HPP_
 
-#include <osmium_geos_factory/geos_factory.hpp>
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <osmium/geom/ogr.hpp>
 #include <osmium/relations/relations_manager.hpp>
+#include <osmium/thread/pool.hpp>
 
 #include "errorsum.hpp"
 #include "tagcheck.hpp"
 #include "datastorage.hpp"
+#include "locationindex.hpp"
 
 
-typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type,
-                                  osmium::Location>
-        index_neg_type;
-        
-typedef osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type,
-                                           osmium::Location>
-        index_pos_type;
-        
-typedef osmium::handler::NodeLocationsForWays<index_pos_type,
-                                              index_neg_type>
-        location_handler_type;
-
-typedef geos::geom::LineString linestring_type;
-
 class WaterwayCollector :
         public osmium::relations::RelationsManager<WaterwayCollector,
                                             false, true, false> {
@@ -44,45 +36,26 @@ class WaterwayCollector :
     static constexpr size_t max_buffer_size_for_flush = 100 * 1024;
 
     DataStorage &ds;
-    osmium_geos_factory::GEOSFactory<> osmium_geos_factory;
-    geos::geom::GeometryFactory::unique_ptr geom_factory;
-
-    std::unique_ptr<OGRGeometry> geos2ogr(const geos::geom::Geometry *g)
-    {
-        OGRGeometry *out;
-
-        geos::io::WKBWriter wkbWriter;
-        wkbWriter.setOutputDimension(g->getCoordinateDimension());
-        std::ostringstream ss;
-        wkbWriter.write(*g, ss);
-        std::string wkb = ss.str();
-        if (OGRGeometryFactory::createFromWkb((unsigned char *) wkb.c_str(),
-                                              nullptr, &out, wkb.size())
-            != OGRERR_NONE ) {
-            assert(false);
-            return std::unique_ptr<OGRGeometry>{};
-        }
-        return std::unique_ptr<OGRGeometry>{out};
-    }
+    osmium::geom::OGRFactory<> ogr_factory;
 
     /***
     * direction error: Nodes where every connected way flows in or out.
     */
     void detect_direction_error(int count_first_node, int count_last_node,
-                                 ErrorSum *sum) {
+                                 ErrorSum &sum) {
         if ((abs(count_first_node - count_last_node) > 1) 
                 && ((count_first_node == 0) || (count_last_node == 0))) {
-            sum->set_direction_error();
+            sum.set_direction_error();
         }
     }
 
     /***
     * name error: Nodes, that connect two ways with different names.
     */
-    void detect_name_error(std::vector<const char*> &names, ErrorSum *sum) {
+    void detect_name_error(std::vector<uint32_t> &names, ErrorSum &sum) {
         if (names.size() == 2) {
-            if (strcmp(names[0],names[1])) {
-                sum->set_name_error();
+            if (names[0] != names[1]) {
+                sum.set_name_error();
             }
         }
     }
@@ -100,7 +73,7 @@ class WaterwayCollector :
      * Remember if its river or stream. Ignore other types of waterway.
      */
     void detect_flow_errors(std::vector<char> &category_in,
-            std::vector<char> &category_out, ErrorSum *sum) {
+            std::vector<char> &category_out, ErrorSum &sum) {
         char max_in = 0;
         char max_out = 0;
         if (category_in.size())
@@ -111,23 +84,23 @@ class WaterwayCollector :
 
         if ((category_out.size()) && (category_in.size())) {
             if ((max_in == 'C') && (max_out < 'C') && (max_out != '?')) {
-                sum->set_type_error();
+                sum.set_type_error();
             }
         } else if (category_in.size() == 1) {
             if (category_in[0] == 'C') {
-                sum->set_poss_rivermouth();
-                sum->set_river();
+                sum.set_poss_rivermouth();
+                sum.set_river();
             } else if (category_in[0] == 'B') {
-                sum->set_poss_rivermouth();
-                sum->set_stream();
+                sum.set_poss_rivermouth();
+                sum.set_stream();
             }
         } else if (category_out.size() == 1) {
             if (category_out[0] == 'C') {
-                sum->set_poss_outflow();
-                sum->set_river();
+                sum.set_poss_outflow();
+                sum.set_river();
             } else if (category_out[0] == 'B'){
-                sum->set_poss_outflow();
-                sum->set_stream();
+                sum.set_poss_outflow();
+                sum.set_stream();
             }
         }
     }
@@ -136,9 +109,9 @@ class WaterwayCollector :
      * If no possibly error or specific is detected, insert node into
      * table nodes.
      */
-    bool handle_node(osmium::object_id_type node_id, ErrorSum *sum) {
+    bool handle_node(osmium::object_id_type node_id, const ErrorSum &sum) {
         osmium::Location location;
-        if (sum->is_normal()) {
+        if (sum.is_normal()) {
             try {
                 location = location_handler.get_node_location(node_id);
             } catch (...) {
@@ -146,34 +119,64 @@ class WaterwayCollector :
                 return false;
             }
             ds.insert_node_feature(location, node_id, sum);
-            delete sum;
         } else {
-            ds.error_map[node_id] = sum;
+            ds.add_error_node(node_id, sum);
         }
         return true;
     }
 
+    /***
+     * Detect the errors of one node of the node_map. Only reads the
+     * waterways, so it is safe to run in worker threads.
+     */
+    ErrorSum detect_errors(const EndpointIndex::Group &node) {
+        int count_first_node = 0;
+        int count_last_node = 0;
+        std::vector<uint32_t> names;
+        std::vector<char> category_in;
+        std::vector<char> category_out;
+        ErrorSum sum;
+
+        for (const auto& entry : node) {
+            DataStorage::WaterWay* wway = &(ds.get_waterway(entry.way_index()));
+            if (entry.is_first()) {
+                count_first_node++;
+                names.push_back(wway->name_id);
+                category_out.push_back(wway->category);
+            }
+            if (entry.is_last()) {
+                count_last_node++;
+                names.push_back(wway->name_id);
+                category_in.push_back(wway->category);
+            }
+        }
+
+        detect_direction_error(count_first_node, count_last_node, sum);
+        detect_name_error(names, sum);
+        detect_flow_errors(category_in, category_out, sum);
+        return sum;
+    }
+
     /***
      * Insert error node into nodes table: way contains of one
      * coordinate.
      */
     void insert_way_error(const osmium::Way &way) {
-        ErrorSum *sum = new ErrorSum();
-        sum->set_way_error();
+        ErrorSum sum;
+        sum.set_way_error();
         ds.insert_node_feature(way.nodes().begin()->location(),
                                way.nodes().begin()->ref(), sum);
-        delete sum;
     }
 
     /***
-     * Iterate through members. Create linestrings of each. First as GEOS
-     * linestring to union them later. Then as ORG linestring to insert
-     * them into table ways.
+     * Iterate through members. Create OGR linestrings of each, add a copy
+     * to the multilinestring of the relation and insert them into table
+     * ways.
      */
     void create_ways(const osmium::Relation &relation,
                      const osmium::object_id_type relation_id,
                      bool &contains_nowaterway_ways,
-                     std::vector<geos::geom::Geometry *> *linestrings) {
+                     OGRMultiLineString &multilinestring) {
         
         for (auto& member : relation.members()) {
             if (member_is_valid(member)) {
@@ -181,11 +184,12 @@ class WaterwayCollector :
                 if (!way) {
                     continue;
                 }
-                linestring_type *linestr = nullptr;
+                const TagClass tags = TagCheck::classify(*way);
+                std::unique_ptr<OGRLineString> linestring;
                 try {
-                    linestr = osmium_geos_factory.create_linestring(*way,
+                    linestring = ogr_factory.create_linestring(*way,
                             osmium::geom::use_nodes::unique,
-                            osmium::geom::direction::forward).release();
+                            osmium::geom::direction::forward);
                 } catch (osmium::geometry_error&) {
                     insert_way_error(*way);
                     continue;
@@ -194,19 +198,18 @@ class WaterwayCollector :
                     std::cerr << "  Unexpected error\n";
                     continue;
                 }
-                if (linestr) {
-                    linestrings->push_back(linestr);
-                } else {
+                if (!linestring) {
                     continue;
                 }
+                multilinestring.addGeometry(linestring.get());
 
-                if (TagCheck::has_waterway_tag(*way)) {
+                if (TagCheck::has_waterway_tag(tags)) {
                     contains_nowaterway_ways = true;
                 }
-                std::unique_ptr<OGRGeometry> ogr_linestring = geos2ogr(linestr);
 
                 try {
-                    ds.insert_way_feature(move(ogr_linestring), *way, relation_id);
+                    ds.insert_way_feature(std::move(linestring), *way, tags,
+                                          relation_id);
                 } catch (osmium::geometry_error&) {
                     std::cerr << "Inserting to table failed for way: "
                          << way->id() << '\n';
@@ -220,37 +223,20 @@ class WaterwayCollector :
     }
 
     /***
-     * Union linestrings to multilinestring and insert them into table
-     * relations.
+     * Insert the multilinestring of the member ways into table relations.
      */
     void create_relation(const osmium::Relation &relation,
+                         const TagClass &tags,
                          const osmium::object_id_type relation_id,
                          bool &contains_nowaterway_ways,
-                         std::vector<geos::geom::Geometry *> *linestrings) {
+                         std::unique_ptr<OGRMultiLineString> multilinestring) {
 
-        if (!(linestrings->size())) {
-            return;
-        }
-        geos::geom::MultiLineString *multi_line_string = nullptr;
-        try {
-            multi_line_string = geom_factory->createMultiLineString(
-                              linestrings);
-        } catch (...) {
-            std::cerr << "Failed to create multilinestring at relation: "
-                 << relation_id << '\n';
-            delete linestrings;
-            return;
-        }
-        std::unique_ptr<OGRGeometry> ogr_multilinestring;
-        try {
-            ogr_multilinestring = move(geos2ogr(multi_line_string));
-        } catch (...) {
-            delete multi_line_string;
+        if (!(multilinestring->getNumGeometries())) {
             return;
         }
         try {
-            ds.insert_relation_feature(std::move(ogr_multilinestring), relation,
-                                       contains_nowaterway_ways);
+            ds.insert_relation_feature(std::move(multilinestring), relation,
+                                       tags, contains_nowaterway_ways);
         } catch (osmium::geometry_error&) {
             std::cerr << "Inserting to table failed for relation: "
                  << relation_id << '\n';
@@ -259,48 +245,20 @@ class WaterwayCollector :
                  << relation_id << '\n';
             std::cerr << "  Unexpected error\n";
         }
-        delete multi_line_string;
     }
 
     void handle_relation(const osmium::Relation& relation) {
         const osmium::object_id_type relation_id = relation.id();
-        std::vector<geos::geom::Geometry *> *linestrings;
-        linestrings = new std::vector<geos::geom::Geometry *>();
+        std::unique_ptr<OGRMultiLineString> multilinestring{
+                new OGRMultiLineString};
         bool contains_nowaterway_ways = false;
         
         create_ways(relation, relation_id, contains_nowaterway_ways,
-                    linestrings);
+                    *multilinestring);
 
-        create_relation(relation, relation_id, contains_nowaterway_ways,
-                         linestrings);
-    }
-
-    void create_single_way(const osmium::Way &way) {
-        osmium::geom::OGRFactory<> ogr_factory;
-        std::unique_ptr<OGRGeometry> linestring;
-        try {
-            linestring = ogr_factory.create_linestring(way,
-                         osmium::geom::use_nodes::unique,
-                         osmium::geom::direction::forward);
-        } catch (osmium::geometry_error&) {
-            insert_way_error(way);
-            return;
-        } catch (...) {
-            std::cerr << "Error at way: " << way.id() << '\n';
-            std::cerr << "  Unexpected error\n";
-            return;
-        }
-
-        try {
-            ds.insert_way_feature(std::move(linestring), way, 0);
-        } catch (osmium::geometry_error&) {
-            std::cerr << "Inserting to table failed for way: "
-                 << way.id() << '\n';
-        } catch (...) {
-            std::cerr << "Inserting to table failed for way: "
-                 << way.id() << '\n';
-            std::cerr << "  Unexpected error\n";
-        }
+        create_relation(relation, TagCheck::classify(relation), relation_id,
+                        contains_nowaterway_ways,
+                        std::move(multilinestring));
     }
 
 public:
@@ -310,7 +268,7 @@ public:
         collector_type(),
         location_handler(location_handler),
         ds(data_storage),
-        geom_factory(geos::geom::GeometryFactory::create()) {
+        ogr_factory() {
     }
 
     ~WaterwayCollector() {
@@ -326,8 +284,12 @@ public:
     }
 
     bool way_is_valid(const osmium::Way& way) {
+        return way_is_valid(TagCheck::classify(way));
+    }
+
+    bool way_is_valid(const TagClass &tags) {
         bool is_relation = false;
-        return TagCheck::is_waterway(way, is_relation);
+        return TagCheck::is_waterway(tags, is_relation);
     }
 
     bool member_is_valid(const osmium::RelationMember& member) {
@@ -346,11 +308,45 @@ public:
      * Insert waterways not in any relation into table ways.
      */
     void way_not_in_any_relation(const osmium::Way& way) {
-        if (way_is_valid(way)) {
-            create_single_way(way);
+        const TagClass tags = TagCheck::classify(way);
+        if (way_is_valid(tags)) {
+            create_single_way(way, tags);
         }
     }
     
+    /***
+     * Insert a single way into table ways. The update mode uses it for the
+     * changed ways with the relations they were member of.
+     */
+    void create_single_way(const osmium::Way &way, const TagClass &tags,
+                           osmium::object_id_type relation_id = 0) {
+        std::unique_ptr<OGRGeometry> linestring;
+        try {
+            linestring = ogr_factory.create_linestring(way,
+                         osmium::geom::use_nodes::unique,
+                         osmium::geom::direction::forward);
+        } catch (osmium::geometry_error&) {
+            insert_way_error(way);
+            return;
+        } catch (...) {
+            std::cerr << "Error at way: " << way.id() << '\n';
+            std::cerr << "  Unexpected error\n";
+            return;
+        }
+
+        try {
+            ds.insert_way_feature(std::move(linestring), way, tags,
+                                  relation_id);
+        } catch (osmium::geometry_error&) {
+            std::cerr << "Inserting to table failed for way: "
+                 << way.id() << '\n';
+        } catch (...) {
+            std::cerr << "Inserting to table failed for way: "
+                 << way.id() << '\n';
+            std::cerr << "  Unexpected error\n";
+        }
+    }
+
     /***
      * Insert waterways and relations of incomplete relations.
      */
@@ -364,42 +360,94 @@ public:
     /***
      * Iterate over node_map, where first_nodes and last_nodes
      * are mapped with the names and categories of the connected
-     * ways to detect errors.
+     * ways to detect errors. Streams over the spilled runs of the node_map
+     * with --memory-limit.
      */
     void analyse_nodes() {
-        int count_first_node, count_last_node;
-        long fid = 1;
-        std::vector<const char*> names;
-        std::vector<char> category_in;
-        std::vector<char> category_out;
-        for (auto node : ds.node_map) {
-            ErrorSum *sum = new ErrorSum();
-            osmium::object_id_type node_id = node.first;
-
-            count_first_node = 0; count_last_node = 0;
-            names.clear(); category_in.clear(); category_out.clear();
-            for (auto wway_idx : node.second) {
-                DataStorage::WaterWay* wway = &(ds.get_waterway(wway_idx));
-                if (wway->first_node == node_id) {
-                    count_first_node++;
-                    names.push_back(wway->name.c_str());
-                    category_out.push_back(wway->category);
-                }
-                if (wway->last_node == node_id) {
-                    count_last_node++;
-                    names.push_back(wway->name.c_str());
-                    category_in.push_back(wway->category);
-                }
-            }
+        ds.node_map.for_each_group([this](const EndpointIndex::Group &node) {
+            analyse_node(node);
+        });
+    }
 
-            detect_direction_error(count_first_node, count_last_node, sum);
-            detect_name_error(names, sum);
-            detect_flow_errors(category_in, category_out, sum);
+    /***
+     * Analyse one node of the node_map with the indexes of its ways. Also
+     * used by the update mode for the nodes touched by changed ways.
+     */
+    bool analyse_node(const EndpointIndex::Group &node) {
+        return handle_node(node.node_id(), detect_errors(node));
+    }
 
-            if (!handle_node(node_id, sum)) {
-                continue;
+    /***
+     * Like analyse_nodes(), but the node_map is split into num_ranges
+     * ranges of node ids. The workers detect the errors of the nodes of a
+     * range and look up the locations of the nodes without errors, which
+     * is the expensive part with a big location index. The results are
+     * written to the error_map and the nodes table one range after the
+     * other, in the order of analyse_nodes(). The ranges need all entries
+     * in memory, a spilled node_map is analysed serially.
+     */
+    void analyse_nodes(osmium::thread::Pool &pool, std::size_t num_ranges) {
+        if (num_ranges < 2 || ds.node_map.spilled()) {
+            analyse_nodes();
+            return;
+        }
+
+        struct NodeResult {
+            ErrorSum sum;
+            osmium::Location location;
+            bool missing;
+        };
+
+        const EndpointIndex::const_iterator begin = ds.node_map.begin();
+        const std::size_t range_size = ds.node_map.size() / num_ranges + 1;
+        std::vector<EndpointIndex::const_iterator> bounds;
+        std::size_t count = 0;
+        for (auto node = begin; node != ds.node_map.end(); ++node, ++count) {
+            if (count % range_size == 0) {
+                bounds.push_back(node);
+            }
+        }
+        bounds.push_back(ds.node_map.end());
+
+        std::vector<std::future<std::vector<NodeResult>>> results;
+        for (std::size_t range = 0; range + 1 < bounds.size(); ++range) {
+            const EndpointIndex::const_iterator first = bounds[range];
+            const EndpointIndex::const_iterator last = bounds[range + 1];
+            results.push_back(pool.submit([this, first, last, range_size] {
+                std::vector<NodeResult> range_results;
+                range_results.reserve(range_size);
+                for (auto node = first; node != last; ++node) {
+                    NodeResult result{detect_errors(*node),
+                                      osmium::Location(), false};
+                    if (result.sum.is_normal()) {
+                        try {
+                            result.location = location_handler
+                                    .get_node_location((*node).node_id());
+                        } catch (...) {
+                            result.missing = true;
+                        }
+                    }
+                    range_results.push_back(result);
+                }
+                return range_results;
+            }));
+        }
+
+        for (std::size_t range = 0; range < results.size(); ++range) {
+            auto node = bounds[range];
+            for (const auto& result : results[range].get()) {
+                const osmium::object_id_type node_id = (*node).node_id();
+                if (!result.sum.is_normal()) {
+                    ds.add_error_node(node_id, result.sum);
+                } else if (result.missing) {
+                    std::cerr << "node without location: " << node_id
+                              << '\n';
+                } else {
+                    ds.insert_node_feature(result.location, node_id,
+                                           result.sum);
+                }
+                ++node;
             }
-            fid++;
         }
     }
 };